@@ -0,0 +1,1859 @@
+/*
+ * blockstore.c -- backing stores for the simulated disk
+ *
+ * See blockstore.h for the spec strings each store accepts.
+ */
+
+#ifndef _POSIX_PTHREAD_SEMANTICS
+#define _POSIX_PTHREAD_SEMANTICS
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_DIRECT
+#endif
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include "sthread.h"
+#include "blockstore.h"
+#include "spec.h"
+
+static void *xmalloc(size_t bytes)
+{
+  void *p = malloc(bytes);
+  if(p == NULL){
+    perror("blockstore allocation failed");
+    exit(-1);
+  }
+  return p;
+}
+
+/*
+ * spec_path()
+ *
+ * Copy the path at the front of "PATH,opt,opt..." into path and
+ * return the options that follow it.
+ */
+static const char *spec_path(const char *rest, char *path, size_t len)
+{
+  const char *comma = strchr(rest, ',');
+  size_t n = comma ? (size_t)(comma - rest) : strlen(rest);
+
+  if(n == 0 || n >= len){
+    fprintf(stderr, "blockstore: bad path in \"%s\"\n", rest);
+    exit(-1);
+  }
+  memcpy(path, rest, n);
+  path[n] = '\0';
+  return comma ? comma + 1 : "";
+}
+
+static void pread_full(int fd, char *buf, size_t len, off_t off)
+{
+  ssize_t n;
+
+  while(len > 0){
+    n = pread(fd, buf, len, off);
+    if(n < 0 && errno == EINTR){
+      continue;
+    }
+    if(n < 0){
+      perror("pread of backing file failed");
+      exit(-1);
+    }
+    if(n == 0){
+      memset(buf, 0, len); // past the end of the file
+      return;
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+}
+
+static void pwrite_full(int fd, const char *buf, size_t len, off_t off)
+{
+  ssize_t n;
+
+  while(len > 0){
+    n = pwrite(fd, buf, len, off);
+    if(n < 0 && errno == EINTR){
+      continue;
+    }
+    if(n < 0){
+      perror("pwrite of backing file failed");
+      exit(-1);
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+}
+
+/*
+ * open_backing_file()
+ *
+ * Open (creating if needed) the file holding the blocks, and make
+ * sure it is big enough. Block devices are left alone.
+ */
+static int open_backing_file(const char *path, int flags, long long bytes)
+{
+  struct stat st;
+  int fd = open(path, O_RDWR | O_CREAT | flags, 0644);
+
+  if(fd < 0){
+    perror(path);
+    exit(-1);
+  }
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < bytes){
+    if(ftruncate(fd, bytes)){
+      perror("ftruncate of backing file failed");
+      exit(-1);
+    }
+  }
+  return fd;
+}
+
+
+/*
+ * The in-memory store, the original simulated disk
+ *
+ * By default every access sleeps for a random 0-100us, which
+ * simulates out of order completion but makes every access pattern
+ * cost the same. With a model the delay is worked out instead from
+ * a few device parameters:
+ *
+ *   service = overhead + seek + blocksize / bandwidth
+ *   seek    = 0 for the block right after the previous one, else
+ *             settle + stroke * distance / nblocks
+ *
+ * and the device works on at most qdepth requests at a time; the
+ * rest wait their turn in FIFO order, so queueing delay shows up
+ * as it would on the real thing.
+ */
+struct disk_model {
+  long long overhead; // fixed per-command cost, ns
+  long long settle; // cost of any non-sequential access, ns
+  long long stroke; // extra cost of seeking across the whole disk, ns
+  long long bandwidth; // transfer rate, bytes per second
+  int qdepth; // requests the device services at once
+};
+
+static const struct {
+  const char *name;
+  struct disk_model model;
+} disk_presets[] = {
+  // 7200rpm: half a rotation plus settle, ~8ms full stroke, no NCQ
+  { "hdd", { 50000, 4500000, 8000000, 150000000LL, 1 } },
+  // SATA SSD: ~80us reads, one NCQ queue of 32
+  { "sata", { 80000, 0, 0, 530000000LL, 32 } },
+  // NVMe SSD: ~15us reads, lots of internal parallelism
+  { "nvme", { 15000, 0, 0, 3200000000LL, 64 } },
+};
+
+struct memory_store {
+  struct blockstore base;
+  char *data;
+  int modeled; // 0 for the original random delay
+  struct disk_model model;
+  smutex_t mutex; // protects the fields below
+  scond_t turn; // a service slot opened up
+  int busy; // requests being serviced
+  unsigned long next_ticket, serving; // FIFO order for free slots
+  int head; // block after the last one accessed
+};
+
+static void memory_load(struct blockstore *bs, const char *block, int blocknum)
+{
+  struct memory_store *ms = (struct memory_store *)bs;
+  memcpy(ms->data + (size_t)blocknum * bs->blocksize, block, bs->blocksize);
+}
+
+/*
+ * memory_delay()
+ *
+ * Spend as long as the device would on one access to count blocks
+ * starting at blocknum.
+ */
+static void memory_delay(struct memory_store *ms, int blocknum, int count)
+{
+  struct disk_model *m = &ms->model;
+  unsigned long ticket;
+  long long ns;
+  int distance;
+
+  if(!ms->modeled){
+    sthread_sleep(0, sthread_rng_below(sthread_rng(), 100000));
+    return;
+  }
+
+  smutex_lock(&ms->mutex);
+  ticket = ms->next_ticket++;
+  while(ticket != ms->serving || ms->busy >= m->qdepth){
+    scond_wait(&ms->turn, &ms->mutex);
+  }
+  ms->serving++;
+  ms->busy++;
+  distance = blocknum - ms->head;
+  ms->head = blocknum + count;
+  scond_broadcast(&ms->turn, &ms->mutex); // the next ticket may fit too
+  smutex_unlock(&ms->mutex);
+
+  ns = m->overhead +
+       (long long)count * ms->base.blocksize * 1000000000LL / m->bandwidth;
+  if(distance != 0){
+    if(distance < 0){
+      distance = -distance;
+    }
+    ns += m->settle + m->stroke * distance / ms->base.nblocks;
+  }
+  sthread_sleep(ns / 1000000000LL, ns % 1000000000LL);
+
+  smutex_lock(&ms->mutex);
+  ms->busy--;
+  scond_broadcast(&ms->turn, &ms->mutex);
+  smutex_unlock(&ms->mutex);
+}
+
+static void memory_read(struct blockstore *bs, char *block, int blocknum)
+{
+  struct memory_store *ms = (struct memory_store *)bs;
+  memcpy(block, ms->data + (size_t)blocknum * bs->blocksize, bs->blocksize);
+  memory_delay(ms, blocknum, 1);
+}
+
+static void memory_write(struct blockstore *bs, const char *block, int blocknum)
+{
+  memory_load(bs, block, blocknum);
+  memory_delay((struct memory_store *)bs, blocknum, 1);
+}
+
+static void memory_readv(struct blockstore *bs, char *const *blocks,
+                         int blocknum, int count)
+{
+  struct memory_store *ms = (struct memory_store *)bs;
+  int i;
+
+  for(i = 0; i < count; i++){
+    memcpy(blocks[i], ms->data + (size_t)(blocknum + i) * bs->blocksize,
+           bs->blocksize);
+  }
+  memory_delay(ms, blocknum, count);
+}
+
+static void memory_writev(struct blockstore *bs, const char *const *blocks,
+                          int blocknum, int count)
+{
+  int i;
+
+  for(i = 0; i < count; i++){
+    memory_load(bs, blocks[i], blocknum + i);
+  }
+  memory_delay((struct memory_store *)bs, blocknum, count);
+}
+
+static void memory_close(struct blockstore *bs)
+{
+  struct memory_store *ms = (struct memory_store *)bs;
+  if(ms->modeled){
+    scond_destroy(&ms->turn);
+    smutex_destroy(&ms->mutex);
+  }
+  free(ms->data);
+  free(ms);
+}
+
+static const struct blockstore_ops memory_ops = {
+  memory_read, memory_write, memory_load, memory_close, NULL,
+  memory_readv, memory_writev
+};
+
+static struct blockstore *memory_open(const char *opts, int nblocks,
+                                      int blocksize)
+{
+  struct memory_store *ms = xmalloc(sizeof(*ms));
+  struct disk_model *m = &ms->model;
+  char val[32];
+  size_t i;
+
+  ms->base.ops = &memory_ops;
+  ms->data = calloc(nblocks, blocksize);
+  if(ms->data == NULL){
+    perror("blockstore allocation failed");
+    exit(-1);
+  }
+
+  ms->modeled = spec_option(opts, "model", val, sizeof(val));
+  if(!ms->modeled){
+    return &ms->base;
+  }
+  for(i = 0; i < sizeof(disk_presets) / sizeof(disk_presets[0]); i++){
+    if(strcmp(val, disk_presets[i].name) == 0){
+      break;
+    }
+  }
+  if(i == sizeof(disk_presets) / sizeof(disk_presets[0])){
+    fprintf(stderr, "blockstore: unknown disk model \"%s\"\n", val);
+    exit(-1);
+  }
+  *m = disk_presets[i].model;
+  m->overhead = spec_number(opts, "overhead", m->overhead);
+  m->settle = spec_number(opts, "settle", m->settle);
+  m->stroke = spec_number(opts, "stroke", m->stroke);
+  m->bandwidth = spec_number(opts, "bandwidth", m->bandwidth);
+  m->qdepth = spec_number(opts, "qdepth", m->qdepth);
+  if(m->bandwidth == 0 || m->qdepth == 0){
+    fprintf(stderr, "blockstore: bandwidth and qdepth must be positive\n");
+    exit(-1);
+  }
+
+  smutex_init_named(&ms->mutex, "memory store");
+  scond_init_named(&ms->turn, "memory store turn");
+  ms->busy = 0;
+  ms->next_ticket = ms->serving = 0;
+  ms->head = 0;
+  return &ms->base;
+}
+
+
+/*
+ * The io_uring store
+ *
+ * Each request borrows one of depth registered buffers (a "slot")
+ * for the duration of the I/O, so that the kernel can skip mapping
+ * the pages on every request. The caller fills in a submission
+ * entry, submits everything that is pending, and sleeps on its
+ * slot's condition variable. A reaper thread waits in
+ * io_uring_enter() for completions and wakes the callers.
+ * Asynchronous requests do not sleep: the reaper copies a read's
+ * data out, frees the slot and calls the request's done function
+ * itself, after dropping the lock.
+ *
+ * Without sqpoll, one caller at a time is the submitter. Callers
+ * that queue an entry while it is inside io_uring_enter() only
+ * bump the pending count and go to sleep on their slot; the
+ * submitter keeps taking the whole pending count and submitting it
+ * in one call until nothing is left. With sqpoll the kernel picks
+ * entries off the ring on its own and only needs a wakeup once its
+ * polling thread has gone idle.
+ */
+#define URING_DEFAULT_DEPTH 64
+#define URING_STOP ((__u64)-1)     // user_data of the reaper's stop NOP
+
+struct uring_slot {
+  char *buf;                       // registered buffer
+  scond_t done;
+  int finished;
+  int res;
+  void (*callback)(void *);        // asynchronous requests only, else NULL
+  void *arg;
+  char *dest;                      // where an asynchronous read goes
+};
+
+struct uring_store {
+  struct blockstore base;
+  int ringfd;
+  int fd;
+  int sqpoll;
+  int depth;
+
+  // submission ring
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_flags;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  // completion ring
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_map;
+  size_t sq_map_len;
+  void *cq_map;
+  size_t cq_map_len;
+  size_t sqes_len;
+
+  smutex_t lock;                   // protects everything below
+  scond_t slotFree;
+  struct uring_slot *slots;
+  int *freeSlots;                  // stack of unused slot numbers
+  int nfree;
+  unsigned pending;                // entries queued but not yet submitted
+  int submitting;                  // somebody is submitting the pending ones
+  long requests;                   // entries queued, for uring_stats
+  long enters;                     // io_uring_enter() calls to submit them
+                                   // (or, with sqpoll, to wake the poller)
+  char *bufs;
+  sthread_t reaper;
+  struct uring_slot *ready;        // the reaper's finished async requests
+};
+
+static int uring_enter(int ringfd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags)
+{
+  int ret;
+
+  do{
+    ret = syscall(__NR_io_uring_enter, ringfd, to_submit, min_complete,
+                  flags, NULL, 0);
+  }while(ret < 0 && errno == EINTR);
+  if(ret < 0){
+    perror("io_uring_enter failed");
+    exit(-1);
+  }
+  return ret;
+}
+
+/*
+ * uring_queue()
+ *
+ * Fill in the next submission entry and make it visible to the
+ * kernel, then get it submitted: if another caller is already
+ * submitting it will take this entry too, otherwise this caller
+ * submits until nothing is pending. Must be called with us->lock
+ * held; drops it around io_uring_enter().
+ */
+static void uring_queue(struct uring_store *us, int opcode, int slot,
+                        int blocknum, __u64 user_data)
+{
+  unsigned tail = *us->sq_tail;
+  unsigned idx = tail & *us->sq_mask;
+  struct io_uring_sqe *sqe = &us->sqes[idx];
+  unsigned n;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  if(opcode != IORING_OP_NOP){
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;                   // index into the registered files
+    sqe->addr = (uintptr_t)us->slots[slot].buf;
+    sqe->len = us->base.blocksize;
+    sqe->off = (__u64)blocknum * us->base.blocksize;
+    sqe->buf_index = slot;
+  }
+  sqe->user_data = user_data;
+  us->sq_array[idx] = idx;
+  __atomic_store_n(us->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  us->requests++;
+
+  if(us->sqpoll){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(us->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP){
+      us->enters++;
+      uring_enter(us->ringfd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+    }
+    return;
+  }
+
+  us->pending++;
+  if(us->submitting){
+    return;
+  }
+  us->submitting = 1;
+  while(us->pending > 0){
+    n = us->pending;
+    us->pending = 0;
+    us->enters++;
+    smutex_unlock(&us->lock);
+    uring_enter(us->ringfd, n, 0, 0);
+    smutex_lock(&us->lock);
+  }
+  us->submitting = 0;
+}
+
+static void uring_check(int res)
+{
+  if(res < 0){
+    errno = -res;
+    perror("io_uring block I/O failed");
+    exit(-1);
+  }
+}
+
+/*
+ * uring_reaper()
+ *
+ * Wake the callers of the completed synchronous requests, and
+ * finish the asynchronous ones: their done functions run once the
+ * lock is dropped, as they may well take locks of their own that
+ * are held by threads waiting for this one.
+ */
+static void *uring_reaper(void *arg)
+{
+  struct uring_store *us = (struct uring_store *)arg;
+  struct io_uring_cqe *cqe;
+  struct uring_slot *slot;
+  unsigned head;
+  int i, nready, stop = 0;
+
+  while(!stop){
+    uring_enter(us->ringfd, 0, 1, IORING_ENTER_GETEVENTS);
+
+    nready = 0;
+    smutex_lock(&us->lock);
+    head = *us->cq_head;
+    while(head != __atomic_load_n(us->cq_tail, __ATOMIC_ACQUIRE)){
+      cqe = &us->cqes[head & *us->cq_mask];
+      if(cqe->user_data == URING_STOP){
+        stop = 1;
+      }
+      else if(us->slots[cqe->user_data].callback != NULL){
+        slot = &us->slots[cqe->user_data];
+        uring_check(cqe->res);
+        if(slot->dest != NULL){
+          memcpy(slot->dest, slot->buf, cqe->res);
+          memset(slot->dest + cqe->res, 0, us->base.blocksize - cqe->res);
+        }
+        us->ready[nready++] = *slot;
+        slot->callback = NULL;
+        us->freeSlots[us->nfree++] = cqe->user_data;
+        scond_signal(&us->slotFree, &us->lock);
+      }
+      else{
+        slot = &us->slots[cqe->user_data];
+        slot->res = cqe->res;
+        slot->finished = 1;
+        scond_signal(&slot->done, &us->lock);
+      }
+      head++;
+    }
+    __atomic_store_n(us->cq_head, head, __ATOMIC_RELEASE);
+    smutex_unlock(&us->lock);
+    for(i = 0; i < nready; i++){
+      us->ready[i].callback(us->ready[i].arg);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * uring_slot_get()
+ *
+ * Wait for a free slot and copy src, if any, into its buffer.
+ * Must be called with us->lock held.
+ */
+static int uring_slot_get(struct uring_store *us, const char *src)
+{
+  int n;
+
+  while(us->nfree == 0){
+    scond_wait(&us->slotFree, &us->lock);
+  }
+  n = us->freeSlots[--us->nfree];
+  if(src != NULL){
+    memcpy(us->slots[n].buf, src, us->base.blocksize);
+  }
+  return n;
+}
+
+/*
+ * uring_io()
+ *
+ * Run one read or write of blocknum through a free slot's buffer
+ * and wait for it to complete. Returns with us->lock held and the
+ * slot still reserved so the caller can copy data out.
+ */
+static int uring_io(struct uring_store *us, int opcode, int blocknum,
+                    const char *src)
+{
+  struct uring_slot *slot;
+  int n;
+
+  smutex_lock(&us->lock);
+  n = uring_slot_get(us, src);
+  slot = &us->slots[n];
+  slot->finished = 0;
+  uring_queue(us, opcode, n, blocknum, n);
+  while(!slot->finished){
+    scond_wait(&slot->done, &us->lock);
+  }
+  uring_check(slot->res);
+  return n;
+}
+
+/*
+ * uring_async()
+ *
+ * Queue a read of blocknum into dest, or a write of src, and
+ * return without waiting for it; the reaper calls done(arg) once
+ * it is complete. Only blocks while every slot is in use.
+ */
+static void uring_async(struct uring_store *us, int opcode, int blocknum,
+                        const char *src, char *dest, void (*done)(void *),
+                        void *arg)
+{
+  struct uring_slot *slot;
+  int n;
+
+  smutex_lock(&us->lock);
+  n = uring_slot_get(us, src);
+  slot = &us->slots[n];
+  slot->callback = done;
+  slot->arg = arg;
+  slot->dest = dest;
+  uring_queue(us, opcode, n, blocknum, n);
+  smutex_unlock(&us->lock);
+}
+
+static void uring_release(struct uring_store *us, int n)
+{
+  us->freeSlots[us->nfree++] = n;
+  scond_signal(&us->slotFree, &us->lock);
+  smutex_unlock(&us->lock);
+}
+
+static void uring_read(struct blockstore *bs, char *block, int blocknum)
+{
+  struct uring_store *us = (struct uring_store *)bs;
+  int n = uring_io(us, IORING_OP_READ_FIXED, blocknum, NULL);
+  int res = us->slots[n].res;
+
+  memcpy(block, us->slots[n].buf, res);
+  memset(block + res, 0, bs->blocksize - res); // past the end of a device
+  uring_release(us, n);
+}
+
+static void uring_write(struct blockstore *bs, const char *block, int blocknum)
+{
+  struct uring_store *us = (struct uring_store *)bs;
+  uring_release(us, uring_io(us, IORING_OP_WRITE_FIXED, blocknum, block));
+}
+
+static void uring_read_async(struct blockstore *bs, char *block,
+                             int blocknum, void (*done)(void *), void *arg)
+{
+  uring_async((struct uring_store *)bs, IORING_OP_READ_FIXED, blocknum,
+              NULL, block, done, arg);
+}
+
+static void uring_write_async(struct blockstore *bs, const char *block,
+                              int blocknum, void (*done)(void *), void *arg)
+{
+  uring_async((struct uring_store *)bs, IORING_OP_WRITE_FIXED, blocknum,
+              block, NULL, done, arg);
+}
+
+static void uring_close(struct blockstore *bs)
+{
+  struct uring_store *us = (struct uring_store *)bs;
+  int i;
+
+  smutex_lock(&us->lock);
+  uring_queue(us, IORING_OP_NOP, 0, 0, URING_STOP);
+  smutex_unlock(&us->lock);
+  sthread_join_p(us->reaper);
+
+  munmap(us->sqes, us->sqes_len);
+  if(us->cq_map != us->sq_map){
+    munmap(us->cq_map, us->cq_map_len);
+  }
+  munmap(us->sq_map, us->sq_map_len);
+  close(us->ringfd);
+  close(us->fd);
+  for(i = 0; i < us->depth; i++){
+    scond_destroy(&us->slots[i].done);
+  }
+  scond_destroy(&us->slotFree);
+  smutex_destroy(&us->lock);
+  free(us->bufs);
+  free(us->slots);
+  free(us->freeSlots);
+  free(us->ready);
+  free(us);
+}
+
+// the initial contents go straight to the file, not through the ring
+static void uring_load(struct blockstore *bs, const char *block, int blocknum)
+{
+  struct uring_store *us = (struct uring_store *)bs;
+  pwrite_full(us->fd, block, bs->blocksize, (off_t)blocknum * bs->blocksize);
+}
+
+static const struct blockstore_ops uring_ops = {
+  uring_read, uring_write, uring_load, uring_close, NULL, NULL, NULL,
+  uring_read_async, uring_write_async
+};
+
+static void *uring_map(int ringfd, size_t len, off_t offset)
+{
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringfd, offset);
+  if(p == MAP_FAILED){
+    perror("io_uring mmap failed");
+    exit(-1);
+  }
+  return p;
+}
+
+static struct blockstore *uring_open(const char *rest, int nblocks,
+                                     int blocksize)
+{
+  struct uring_store *us = xmalloc(sizeof(*us));
+  struct io_uring_params params;
+  struct iovec *iovs;
+  char path[4096], val[32];
+  const char *opts;
+  char *sq, *cq;
+  int i;
+
+  memset(us, 0, sizeof(*us));
+  us->base.ops = &uring_ops;
+  opts = spec_path(rest, path, sizeof(path));
+  us->depth = URING_DEFAULT_DEPTH;
+  if(spec_option(opts, "depth", val, sizeof(val)) && atoi(val) > 0){
+    us->depth = atoi(val);
+  }
+  us->sqpoll = spec_option(opts, "sqpoll", val, sizeof(val));
+  us->fd = open_backing_file(path, 0, (long long)nblocks * blocksize);
+
+  // room for every slot plus the stop NOP
+  memset(&params, 0, sizeof(params));
+  if(us->sqpoll){
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = 100; // ms
+  }
+  us->ringfd = syscall(__NR_io_uring_setup, us->depth + 1, &params);
+  if(us->ringfd < 0){
+    perror("io_uring_setup failed");
+    exit(-1);
+  }
+
+  us->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  us->cq_map_len = params.cq_off.cqes +
+                   params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    if(us->cq_map_len > us->sq_map_len){
+      us->sq_map_len = us->cq_map_len;
+    }
+    us->sq_map = uring_map(us->ringfd, us->sq_map_len, IORING_OFF_SQ_RING);
+    us->cq_map = us->sq_map;
+  }
+  else{
+    us->sq_map = uring_map(us->ringfd, us->sq_map_len, IORING_OFF_SQ_RING);
+    us->cq_map = uring_map(us->ringfd, us->cq_map_len, IORING_OFF_CQ_RING);
+  }
+  us->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  us->sqes = uring_map(us->ringfd, us->sqes_len, IORING_OFF_SQES);
+
+  sq = us->sq_map;
+  us->sq_head = (unsigned *)(sq + params.sq_off.head);
+  us->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  us->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  us->sq_flags = (unsigned *)(sq + params.sq_off.flags);
+  us->sq_array = (unsigned *)(sq + params.sq_off.array);
+  cq = us->cq_map;
+  us->cq_head = (unsigned *)(cq + params.cq_off.head);
+  us->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  us->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  us->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  // register the file and one buffer per slot
+  if(syscall(__NR_io_uring_register, us->ringfd, IORING_REGISTER_FILES,
+             &us->fd, 1) < 0){
+    perror("io_uring file registration failed");
+    exit(-1);
+  }
+  if(posix_memalign((void **)&us->bufs, sysconf(_SC_PAGESIZE),
+                    (size_t)us->depth * blocksize)){
+    perror("blockstore allocation failed");
+    exit(-1);
+  }
+  us->slots = xmalloc(us->depth * sizeof(*us->slots));
+  us->ready = xmalloc(us->depth * sizeof(*us->ready));
+  us->freeSlots = xmalloc(us->depth * sizeof(int));
+  iovs = xmalloc(us->depth * sizeof(*iovs));
+  for(i = 0; i < us->depth; i++){
+    us->slots[i].buf = us->bufs + (size_t)i * blocksize;
+    us->slots[i].callback = NULL;
+    scond_init_named(&us->slots[i].done, "uring slot done");
+    us->freeSlots[i] = i;
+    iovs[i].iov_base = us->slots[i].buf;
+    iovs[i].iov_len = blocksize;
+  }
+  us->nfree = us->depth;
+  if(syscall(__NR_io_uring_register, us->ringfd, IORING_REGISTER_BUFFERS,
+             iovs, us->depth) < 0){
+    perror("io_uring buffer registration failed");
+    exit(-1);
+  }
+  free(iovs);
+
+  smutex_init_named(&us->lock, "uring store");
+  scond_init_named(&us->slotFree, "uring slot free");
+  sthread_create_p(&us->reaper, uring_reaper, us);
+  return &us->base;
+}
+
+
+/*
+ * The pread/pwrite store
+ *
+ * Plain positioned reads and writes, straight into the caller's
+ * buffer. With O_DIRECT the page cache is bypassed, so we do not
+ * cache every block twice (once in the page cache and once in
+ * ours), but the kernel then wants the buffer, offset and length
+ * all aligned to the device's logical block size. Requests are
+ * widened to aligned boundaries and bounced through a pool of
+ * aligned buffers. A block smaller than the alignment shares its
+ * sector with its neighbours, so writing it is a read-modify-write
+ * of the whole sector, done under a lock hashed from the sector.
+ */
+#define PREAD_DEFAULT_BUFFERS 64
+#define PREAD_DEFAULT_ALIGN 4096
+#define PREAD_LOCKS 64
+
+struct pread_store {
+  struct blockstore base;
+  int fd;
+  int direct;
+  size_t align;                    // O_DIRECT alignment
+  size_t bufsize;                  // size of each pooled buffer
+  char *bufs;
+  squeue_t pool;                   // free aligned buffers
+  smutex_t locks[PREAD_LOCKS];     // sector read-modify-write locks
+};
+
+/*
+ * pread_window()
+ *
+ * The aligned byte range [*start, *start + *len) covering blocknum.
+ */
+static void pread_window(struct pread_store *ps, int blocknum,
+                         off_t *start, size_t *len)
+{
+  off_t first = (off_t)blocknum * ps->base.blocksize;
+  off_t last = first + ps->base.blocksize;
+
+  *start = first - first % ps->align;
+  last = (last + ps->align - 1) / ps->align * ps->align;
+  *len = last - *start;
+}
+
+static void pread_read(struct blockstore *bs, char *block, int blocknum)
+{
+  struct pread_store *ps = (struct pread_store *)bs;
+  off_t start;
+  size_t len;
+  char *buf;
+
+  if(!ps->direct){
+    pread_full(ps->fd, block, bs->blocksize, (off_t)blocknum * bs->blocksize);
+    return;
+  }
+  pread_window(ps, blocknum, &start, &len);
+  buf = squeue_pop(&ps->pool);
+  pread_full(ps->fd, buf, len, start);
+  memcpy(block, buf + ((off_t)blocknum * bs->blocksize - start), bs->blocksize);
+  squeue_push(&ps->pool, buf);
+}
+
+static void pread_write(struct blockstore *bs, const char *block, int blocknum)
+{
+  struct pread_store *ps = (struct pread_store *)bs;
+  off_t start, first = (off_t)blocknum * bs->blocksize;
+  size_t len;
+  smutex_t *lock = NULL;
+  char *buf;
+
+  if(!ps->direct){
+    pwrite_full(ps->fd, block, bs->blocksize, first);
+    return;
+  }
+  pread_window(ps, blocknum, &start, &len);
+  buf = squeue_pop(&ps->pool);
+  if(len != (size_t)bs->blocksize){
+    lock = &ps->locks[(start / ps->align) % PREAD_LOCKS];
+    smutex_lock(lock);
+    pread_full(ps->fd, buf, len, start);
+  }
+  memcpy(buf + (first - start), block, bs->blocksize);
+  pwrite_full(ps->fd, buf, len, start);
+  if(lock != NULL){
+    smutex_unlock(lock);
+  }
+  squeue_push(&ps->pool, buf);
+}
+
+static void pread_close(struct blockstore *bs)
+{
+  struct pread_store *ps = (struct pread_store *)bs;
+  int i;
+
+  if(ps->direct){
+    squeue_destroy(&ps->pool);
+    free(ps->bufs);
+  }
+  for(i = 0; i < PREAD_LOCKS; i++){
+    smutex_destroy(&ps->locks[i]);
+  }
+  close(ps->fd);
+  free(ps);
+}
+
+/*
+ * Without O_DIRECT the page cache is in play, so pass hints on
+ * to it.
+ */
+static void pread_hint(struct blockstore *bs, int blocknum, int count, int hint)
+{
+  struct pread_store *ps = (struct pread_store *)bs;
+
+  if(!ps->direct){
+    posix_fadvise(ps->fd, (off_t)blocknum * bs->blocksize,
+                  (off_t)count * bs->blocksize,
+                  hint == BLOCKSTORE_WILLNEED ? POSIX_FADV_WILLNEED
+                                              : POSIX_FADV_DONTNEED);
+  }
+}
+
+static const struct blockstore_ops pread_ops = {
+  pread_read, pread_write, NULL, pread_close, pread_hint, NULL, NULL
+};
+
+static struct blockstore *pread_open(const char *rest, int nblocks,
+                                     int blocksize)
+{
+  struct pread_store *ps = xmalloc(sizeof(*ps));
+  char path[4096], val[32];
+  const char *opts;
+  struct stat st;
+  int i, nbufs, sector;
+
+  memset(ps, 0, sizeof(*ps));
+  ps->base.ops = &pread_ops;
+  opts = spec_path(rest, path, sizeof(path));
+  ps->direct = spec_option(opts, "direct", val, sizeof(val));
+  ps->fd = open_backing_file(path, ps->direct ? O_DIRECT : 0,
+                             (long long)nblocks * blocksize);
+  for(i = 0; i < PREAD_LOCKS; i++){
+    smutex_init_named(&ps->locks[i], "pread block lock");
+  }
+  if(!ps->direct){
+    return &ps->base;
+  }
+
+  ps->align = PREAD_DEFAULT_ALIGN;
+  if(fstat(ps->fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+     ioctl(ps->fd, BLKSSZGET, &sector) == 0 && sector > 0){
+    ps->align = sector;
+  }
+  if(spec_option(opts, "align", val, sizeof(val)) && atoi(val) > 0){
+    ps->align = atoi(val);
+  }
+  if(ps->align % blocksize != 0 && blocksize % ps->align != 0){
+    fprintf(stderr, "blockstore: block size %d and O_DIRECT alignment %zu "
+            "must divide one another\n", blocksize, ps->align);
+    exit(-1);
+  }
+
+  nbufs = PREAD_DEFAULT_BUFFERS;
+  if(spec_option(opts, "buffers", val, sizeof(val)) && atoi(val) > 0){
+    nbufs = atoi(val);
+  }
+  ps->bufsize = (blocksize + ps->align - 1) / ps->align * ps->align;
+  if(posix_memalign((void **)&ps->bufs, ps->align, (size_t)nbufs * ps->bufsize)){
+    perror("blockstore allocation failed");
+    exit(-1);
+  }
+  squeue_init(&ps->pool, nbufs);
+  for(i = 0; i < nbufs; i++){
+    squeue_push(&ps->pool, ps->bufs + (size_t)i * ps->bufsize);
+  }
+  return &ps->base;
+}
+
+
+/*
+ * The mmap store
+ *
+ * The whole file is mapped shared, so a read or write is just a
+ * memcpy and any page faults are the kernel's business. This is
+ * the kernel-managed alternative to our own cache.
+ *
+ * madvise() works on whole pages, which may hold many blocks:
+ * WILLNEED is widened to the pages around the blocks (prefetching
+ * a bit more is harmless), while DONTNEED is narrowed to the pages
+ * lying entirely inside them so we never drop a neighbour's data.
+ */
+struct mmap_store {
+  struct blockstore base;
+  int fd;
+  char *map;
+  size_t len;
+};
+
+static void mmap_read(struct blockstore *bs, char *block, int blocknum)
+{
+  struct mmap_store *ms = (struct mmap_store *)bs;
+  memcpy(block, ms->map + (size_t)blocknum * bs->blocksize, bs->blocksize);
+}
+
+static void mmap_write(struct blockstore *bs, const char *block, int blocknum)
+{
+  struct mmap_store *ms = (struct mmap_store *)bs;
+  memcpy(ms->map + (size_t)blocknum * bs->blocksize, block, bs->blocksize);
+}
+
+static void mmap_hint(struct blockstore *bs, int blocknum, int count, int hint)
+{
+  struct mmap_store *ms = (struct mmap_store *)bs;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t first = (size_t)blocknum * bs->blocksize;
+  size_t last = first + (size_t)count * bs->blocksize;
+
+  if(last > ms->len){
+    last = ms->len;
+  }
+  if(hint == BLOCKSTORE_WILLNEED){
+    first = first / page * page;
+    last = (last + page - 1) / page * page;
+    if(last > first){
+      madvise(ms->map + first, last - first, MADV_WILLNEED);
+    }
+  }
+  else{
+    first = (first + page - 1) / page * page;
+    last = last / page * page;
+    if(last > first){
+      madvise(ms->map + first, last - first, MADV_DONTNEED);
+    }
+  }
+}
+
+static void mmap_close(struct blockstore *bs)
+{
+  struct mmap_store *ms = (struct mmap_store *)bs;
+
+  if(msync(ms->map, ms->len, MS_SYNC)){
+    perror("msync of backing file failed");
+    exit(-1);
+  }
+  munmap(ms->map, ms->len);
+  close(ms->fd);
+  free(ms);
+}
+
+static const struct blockstore_ops mmap_ops = {
+  mmap_read, mmap_write, NULL, mmap_close, mmap_hint, NULL, NULL
+};
+
+static struct blockstore *mmap_open(const char *rest, int nblocks,
+                                    int blocksize)
+{
+  struct mmap_store *ms = xmalloc(sizeof(*ms));
+  char path[4096], val[32];
+  const char *opts;
+  int advice = MADV_NORMAL;
+
+  ms->base.ops = &mmap_ops;
+  opts = spec_path(rest, path, sizeof(path));
+  if(spec_option(opts, "advice", val, sizeof(val))){
+    if(strcmp(val, "random") == 0){
+      advice = MADV_RANDOM;
+    }
+    else if(strcmp(val, "sequential") == 0){
+      advice = MADV_SEQUENTIAL;
+    }
+    else if(strcmp(val, "normal") != 0){
+      fprintf(stderr, "blockstore: unknown advice \"%s\"\n", val);
+      exit(-1);
+    }
+  }
+  ms->len = (size_t)nblocks * blocksize;
+  ms->fd = open_backing_file(path, 0, ms->len);
+  ms->map = mmap(NULL, ms->len, PROT_READ | PROT_WRITE, MAP_SHARED, ms->fd, 0);
+  if(ms->map == MAP_FAILED){
+    perror("mmap of backing file failed");
+    exit(-1);
+  }
+  madvise(ms->map, ms->len, advice);
+  return &ms->base;
+}
+
+
+/*
+ * Stores made of other stores
+ *
+ * The mirror and stripe stores hand requests for their child stores
+ * to a pool of worker threads, so that they can run in parallel (and
+ * so that a caller can stop waiting on a slow one). Each request is
+ * a job with a future that is set when it is done. A job is shared
+ * by the caller and the worker, and whichever lets go last frees it.
+ * The workers are OS threads, so these stores are not simulated in
+ * virtual time.
+ */
+#define CHILD_MAX 8
+
+struct child_job {
+  struct blockstore *child;
+  int write;
+  int blocknum;
+  int count;
+  char **blocks; // count buffers for blocknum, blocknum + 1, ...
+  char *own; // buffer the job allocated itself, if any
+  long long start; // sthread_now_ns() at submission
+  void (*timed)(void *arg, long long ns); // told how long it took
+  void *arg;
+  sfuture_t done;
+  int refs;
+};
+
+struct child_pool {
+  squeue_t jobs;
+  int nworkers;
+  sthread_t *workers;
+};
+
+static void child_release(struct child_job *job)
+{
+  if(__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0){
+    sfuture_destroy(&job->done);
+    free(job->own);
+    free(job->blocks);
+    free(job);
+  }
+}
+
+static void *child_worker(void *arg)
+{
+  struct child_pool *pool = (struct child_pool *)arg;
+  struct child_job *job;
+
+  while((job = (struct child_job *)squeue_pop(&pool->jobs)) != NULL){
+    if(job->write){
+      blockstore_writev(job->child, (const char *const *)job->blocks,
+                        job->blocknum, job->count);
+    }
+    else{
+      blockstore_readv(job->child, job->blocks, job->blocknum, job->count);
+    }
+    if(job->timed != NULL){
+      job->timed(job->arg, sthread_now_ns() - job->start);
+    }
+    sfuture_set(&job->done, NULL);
+    child_release(job);
+  }
+  return NULL;
+}
+
+static void child_pool_start(struct child_pool *pool, int nworkers)
+{
+  int i;
+
+  if(nworkers < 1){
+    fprintf(stderr, "blockstore: workers must be positive\n");
+    exit(-1);
+  }
+  squeue_init(&pool->jobs, 1024);
+  pool->nworkers = nworkers;
+  pool->workers = xmalloc(nworkers * sizeof(sthread_t));
+  for(i = 0; i < nworkers; i++){
+    sthread_create_p(&pool->workers[i], child_worker, pool);
+  }
+}
+
+static void child_pool_stop(struct child_pool *pool)
+{
+  int i;
+
+  for(i = 0; i < pool->nworkers; i++){
+    squeue_push(&pool->jobs, NULL);
+  }
+  for(i = 0; i < pool->nworkers; i++){
+    sthread_join_p(pool->workers[i]);
+  }
+  squeue_destroy(&pool->jobs);
+  free(pool->workers);
+}
+
+/*
+ * child_submit()
+ *
+ * Queue count blocks of I/O on child. blocks is copied (the buffers
+ * themselves are not); if it is NULL the job reads into a buffer of
+ * its own, job->own. The caller must child_release() the job.
+ */
+static struct child_job *child_submit(struct child_pool *pool,
+                                      struct blockstore *child, int write,
+                                      char **blocks, int blocknum, int count)
+{
+  struct child_job *job = xmalloc(sizeof(*job));
+
+  job->child = child;
+  job->write = write;
+  job->blocknum = blocknum;
+  job->count = count;
+  job->blocks = xmalloc(count * sizeof(char *));
+  job->own = NULL;
+  if(blocks != NULL){
+    memcpy(job->blocks, blocks, count * sizeof(char *));
+  }
+  else{
+    assert(count == 1);
+    job->own = job->blocks[0] = xmalloc(child->blocksize);
+  }
+  job->start = sthread_now_ns();
+  job->timed = NULL;
+  job->refs = 2;
+  sfuture_init(&job->done);
+  return job;
+}
+
+static void child_run(struct child_pool *pool, struct child_job *job)
+{
+  squeue_push(&pool->jobs, job);
+}
+
+/*
+ * open_children()
+ *
+ * Open the child stores of "OPTS:SPEC|SPEC|...", each with nblocks
+ * blocks, copying OPTS into opts. Returns how many there are.
+ */
+static int open_children(const char *kind, const char *rest, char *opts,
+                         size_t optslen, struct blockstore **children,
+                         int (*nblocks)(int nchildren, void *arg), void *arg,
+                         int blocksize)
+{
+  const char *colon = strchr(rest, ':'), *p, *bar;
+  char *specs[CHILD_MAX];
+  int n = 0, i, each;
+  size_t len;
+
+  if(colon == NULL || (size_t)(colon - rest) >= optslen){
+    fprintf(stderr, "blockstore: bad %s spec \"%s\"\n", kind, rest);
+    exit(-1);
+  }
+  memcpy(opts, rest, colon - rest);
+  opts[colon - rest] = '\0';
+
+  for(p = colon + 1; ; p = bar + 1){
+    bar = strchr(p, '|');
+    len = bar ? (size_t)(bar - p) : strlen(p);
+    if(len == 0 || n == CHILD_MAX){
+      fprintf(stderr, "blockstore: bad %s spec \"%s\"\n", kind, rest);
+      exit(-1);
+    }
+    specs[n] = xmalloc(len + 1);
+    memcpy(specs[n], p, len);
+    specs[n++][len] = '\0';
+    if(bar == NULL){
+      break;
+    }
+  }
+  each = nblocks(n, arg);
+  for(i = 0; i < n; i++){
+    children[i] = blockstore_open(specs[i], each, blocksize);
+    free(specs[i]);
+  }
+  return n;
+}
+
+
+/*
+ * The mirror store
+ *
+ * Every block is kept on all the mirrors. Writes go to all of them
+ * in parallel and finish when the slowest does. A read goes to one
+ * mirror (taking turns), and if it is still not back after the
+ * hedge delay a second read goes to the next mirror; whichever
+ * answers first wins and the other is left to finish on its own.
+ *
+ * The hedge delay is the hedge-th percentile of recent read times,
+ * so only the slowest few percent of reads get hedged, but never
+ * less than floor ns.
+ */
+#define MIRROR_SAMPLES 256 // read times the hedge delay is taken from
+#define MIRROR_RECOMPUTE 32 // samples between hedge delay updates
+
+struct mirror_store {
+  struct blockstore base;
+  int nmirrors;
+  struct blockstore *mirrors[CHILD_MAX];
+  int hedge; // percentile, 0 for no hedging
+  long long floor; // least hedge delay, ns
+  struct child_pool pool;
+  unsigned long next; // mirror the next read goes to first
+  smutex_t mutex; // protects the fields below
+  long long samples[MIRROR_SAMPLES];
+  unsigned long nsamples;
+  long long delay; // current hedge delay, ns
+};
+
+static int cmp_ll(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+// record how long a read took, and now and then update the delay
+static void mirror_sample(void *arg, long long ns)
+{
+  struct mirror_store *ms = (struct mirror_store *)arg;
+  long long sorted[MIRROR_SAMPLES];
+  int n;
+
+  smutex_lock(&ms->mutex);
+  ms->samples[ms->nsamples++ % MIRROR_SAMPLES] = ns;
+  if(ms->nsamples % MIRROR_RECOMPUTE == 0){
+    n = ms->nsamples < MIRROR_SAMPLES ? ms->nsamples : MIRROR_SAMPLES;
+    memcpy(sorted, ms->samples, n * sizeof(sorted[0]));
+    qsort(sorted, n, sizeof(sorted[0]), cmp_ll);
+    ms->delay = sorted[(n - 1) * ms->hedge / 100];
+    if(ms->delay < ms->floor){
+      ms->delay = ms->floor;
+    }
+  }
+  smutex_unlock(&ms->mutex);
+}
+
+static struct child_job *mirror_submit_read(struct mirror_store *ms, int m,
+                                            int blocknum)
+{
+  struct child_job *job;
+
+  job = child_submit(&ms->pool, ms->mirrors[m], 0, NULL, blocknum, 1);
+  job->timed = mirror_sample;
+  job->arg = ms;
+  child_run(&ms->pool, job);
+  return job;
+}
+
+static void mirror_read(struct blockstore *bs, char *block, int blocknum)
+{
+  struct mirror_store *ms = (struct mirror_store *)bs;
+  struct child_job *jobs[2];
+  sfuture_t *futures[2];
+  long long delay;
+  int m, n = 1, first = 0;
+
+  m = __atomic_fetch_add(&ms->next, 1, __ATOMIC_RELAXED) % ms->nmirrors;
+  jobs[0] = mirror_submit_read(ms, m, blocknum);
+  futures[0] = &jobs[0]->done;
+  if(ms->hedge > 0){
+    delay = __atomic_load_n(&ms->delay, __ATOMIC_RELAXED);
+    if(!sfuture_timedwait(futures[0], delay / 1000000000,
+                          delay % 1000000000, NULL)){
+      // slow one, ask the next mirror too and take whichever is first
+      jobs[1] = mirror_submit_read(ms, (m + 1) % ms->nmirrors, blocknum);
+      futures[1] = &jobs[1]->done;
+      n = 2;
+      first = sfuture_wait_any(futures, 2);
+    }
+  }
+  else{
+    sfuture_wait(futures[0]);
+  }
+  memcpy(block, jobs[first]->own, bs->blocksize);
+  child_release(jobs[0]);
+  if(n == 2){
+    child_release(jobs[1]);
+  }
+}
+
+static void mirror_write(struct blockstore *bs, const char *block,
+                         int blocknum)
+{
+  struct mirror_store *ms = (struct mirror_store *)bs;
+  struct child_job *jobs[CHILD_MAX];
+  sfuture_t *futures[CHILD_MAX];
+  char *blocks[1] = { (char *)block };
+  int i;
+
+  for(i = 0; i < ms->nmirrors; i++){
+    jobs[i] = child_submit(&ms->pool, ms->mirrors[i], 1, blocks, blocknum, 1);
+    futures[i] = &jobs[i]->done;
+    child_run(&ms->pool, jobs[i]);
+  }
+  sfuture_wait_all(futures, ms->nmirrors);
+  for(i = 0; i < ms->nmirrors; i++){
+    child_release(jobs[i]);
+  }
+}
+
+static void mirror_load(struct blockstore *bs, const char *block, int blocknum)
+{
+  struct mirror_store *ms = (struct mirror_store *)bs;
+  int i;
+
+  for(i = 0; i < ms->nmirrors; i++){
+    blockstore_load(ms->mirrors[i], block, blocknum);
+  }
+}
+
+static void mirror_hint(struct blockstore *bs, int blocknum, int count,
+                        int hint)
+{
+  struct mirror_store *ms = (struct mirror_store *)bs;
+  int i;
+
+  for(i = 0; i < ms->nmirrors; i++){
+    blockstore_hint(ms->mirrors[i], blocknum, count, hint);
+  }
+}
+
+static void mirror_close(struct blockstore *bs)
+{
+  struct mirror_store *ms = (struct mirror_store *)bs;
+  int i;
+
+  child_pool_stop(&ms->pool);
+  for(i = 0; i < ms->nmirrors; i++){
+    blockstore_close(ms->mirrors[i]);
+  }
+  smutex_destroy(&ms->mutex);
+  free(ms);
+}
+
+static const struct blockstore_ops mirror_ops = {
+  mirror_read, mirror_write, mirror_load, mirror_close, mirror_hint,
+  NULL, NULL
+};
+
+static int mirror_nblocks(int nmirrors, void *arg)
+{
+  return *(int *)arg; // each mirror holds everything
+}
+
+static struct blockstore *mirror_open(const char *rest, int nblocks,
+                                      int blocksize)
+{
+  struct mirror_store *ms = xmalloc(sizeof(*ms));
+  char opts[256];
+
+  ms->nmirrors = open_children("mirror", rest, opts, sizeof(opts),
+                               ms->mirrors, mirror_nblocks, &nblocks,
+                               blocksize);
+  ms->base.ops = &mirror_ops;
+  ms->hedge = spec_number(opts, "hedge", 95);
+  ms->floor = spec_number(opts, "floor", 100000);
+  if(ms->hedge > 100){
+    fprintf(stderr, "blockstore: hedge must be 0-100\n");
+    exit(-1);
+  }
+  if(ms->nmirrors < 2){
+    ms->hedge = 0; // nobody to hedge to
+  }
+  smutex_init_named(&ms->mutex, "mirror store");
+  ms->nsamples = 0;
+  ms->delay = ms->floor;
+  ms->next = 0;
+  child_pool_start(&ms->pool, spec_number(opts, "workers", 16));
+  return &ms->base;
+}
+
+
+/*
+ * The stripe store
+ *
+ * Like RAID-0: the blocks are dealt out to the stripes unit at a
+ * time, so blocks 0..unit-1 go to stripe 0, the next unit blocks to
+ * stripe 1 and so on round the stripes. A single block read or
+ * write goes straight to its stripe, while a multi-block one is
+ * split into one request per stripe (a run of consecutive blocks is
+ * consecutive on each stripe too) and those run in parallel, the
+ * caller doing one of them itself.
+ */
+struct stripe_store {
+  struct blockstore base;
+  int nstripes;
+  struct blockstore *stripes[CHILD_MAX];
+  int unit; // blocks per stripe unit
+  struct child_pool pool;
+};
+
+struct stripe_part {
+  int first; // block on the stripe
+  int count;
+  char **blocks;
+};
+
+// which stripe blocknum is on, and where on it
+static int stripe_locate(struct stripe_store *ss, int blocknum, int *local)
+{
+  int row = blocknum / ss->unit;
+
+  *local = row / ss->nstripes * ss->unit + blocknum % ss->unit;
+  return row % ss->nstripes;
+}
+
+/*
+ * stripe_split()
+ *
+ * Divide count blocks from blocknum among the stripes. blocks may
+ * be NULL if there are no buffers to go with them. Free the parts'
+ * blocks arrays when done.
+ */
+static void stripe_split(struct stripe_store *ss, char *const *blocks,
+                         int blocknum, int count, struct stripe_part *parts)
+{
+  int i, s, local;
+
+  for(s = 0; s < ss->nstripes; s++){
+    parts[s].count = 0;
+    parts[s].blocks = blocks ? xmalloc(count * sizeof(char *)) : NULL;
+  }
+  for(i = 0; i < count; i++){
+    s = stripe_locate(ss, blocknum + i, &local);
+    if(parts[s].count == 0){
+      parts[s].first = local;
+    }
+    assert(local == parts[s].first + parts[s].count);
+    if(blocks){
+      parts[s].blocks[parts[s].count] = blocks[i];
+    }
+    parts[s].count++;
+  }
+}
+
+static void stripe_read(struct blockstore *bs, char *block, int blocknum)
+{
+  struct stripe_store *ss = (struct stripe_store *)bs;
+  int local, s = stripe_locate(ss, blocknum, &local);
+
+  blockstore_read(ss->stripes[s], block, local);
+}
+
+static void stripe_write(struct blockstore *bs, const char *block,
+                         int blocknum)
+{
+  struct stripe_store *ss = (struct stripe_store *)bs;
+  int local, s = stripe_locate(ss, blocknum, &local);
+
+  blockstore_write(ss->stripes[s], block, local);
+}
+
+static void stripe_load(struct blockstore *bs, const char *block,
+                        int blocknum)
+{
+  struct stripe_store *ss = (struct stripe_store *)bs;
+  int local, s = stripe_locate(ss, blocknum, &local);
+
+  blockstore_load(ss->stripes[s], block, local);
+}
+
+static void stripe_io(struct stripe_store *ss, int write, char *const *blocks,
+                      int blocknum, int count)
+{
+  struct stripe_part parts[CHILD_MAX];
+  struct child_job *jobs[CHILD_MAX];
+  sfuture_t *futures[CHILD_MAX];
+  int s, njobs = 0, mine = -1;
+
+  stripe_split(ss, blocks, blocknum, count, parts);
+  for(s = 0; s < ss->nstripes; s++){
+    if(parts[s].count == 0){
+      continue;
+    }
+    if(mine == -1){
+      mine = s; // done by the caller below
+      continue;
+    }
+    jobs[njobs] = child_submit(&ss->pool, ss->stripes[s], write,
+                               parts[s].blocks, parts[s].first,
+                               parts[s].count);
+    futures[njobs] = &jobs[njobs]->done;
+    child_run(&ss->pool, jobs[njobs++]);
+  }
+  if(mine != -1){
+    if(write){
+      blockstore_writev(ss->stripes[mine],
+                        (const char *const *)parts[mine].blocks,
+                        parts[mine].first, parts[mine].count);
+    }
+    else{
+      blockstore_readv(ss->stripes[mine], parts[mine].blocks,
+                       parts[mine].first, parts[mine].count);
+    }
+  }
+  sfuture_wait_all(futures, njobs);
+  for(s = 0; s < njobs; s++){
+    child_release(jobs[s]);
+  }
+  for(s = 0; s < ss->nstripes; s++){
+    free(parts[s].blocks);
+  }
+}
+
+static void stripe_readv(struct blockstore *bs, char *const *blocks,
+                         int blocknum, int count)
+{
+  stripe_io((struct stripe_store *)bs, 0, blocks, blocknum, count);
+}
+
+static void stripe_writev(struct blockstore *bs, const char *const *blocks,
+                          int blocknum, int count)
+{
+  stripe_io((struct stripe_store *)bs, 1, (char *const *)blocks, blocknum,
+            count);
+}
+
+static void stripe_hint(struct blockstore *bs, int blocknum, int count,
+                        int hint)
+{
+  struct stripe_store *ss = (struct stripe_store *)bs;
+  struct stripe_part parts[CHILD_MAX];
+  int s;
+
+  stripe_split(ss, NULL, blocknum, count, parts);
+  for(s = 0; s < ss->nstripes; s++){
+    if(parts[s].count > 0){
+      blockstore_hint(ss->stripes[s], parts[s].first, parts[s].count, hint);
+    }
+  }
+}
+
+static void stripe_close(struct blockstore *bs)
+{
+  struct stripe_store *ss = (struct stripe_store *)bs;
+  int i;
+
+  child_pool_stop(&ss->pool);
+  for(i = 0; i < ss->nstripes; i++){
+    blockstore_close(ss->stripes[i]);
+  }
+  free(ss);
+}
+
+static const struct blockstore_ops stripe_ops = {
+  stripe_read, stripe_write, stripe_load, stripe_close, stripe_hint,
+  stripe_readv, stripe_writev
+};
+
+struct stripe_geometry {
+  int nblocks;
+  int unit;
+};
+
+static int stripe_nblocks(int nstripes, void *arg)
+{
+  struct stripe_geometry *g = (struct stripe_geometry *)arg;
+  int units = (g->nblocks + g->unit - 1) / g->unit;
+
+  return (units + nstripes - 1) / nstripes * g->unit;
+}
+
+static struct blockstore *stripe_open(const char *rest, int nblocks,
+                                      int blocksize)
+{
+  struct stripe_store *ss = xmalloc(sizeof(*ss));
+  struct stripe_geometry g;
+  const char *colon = strchr(rest, ':');
+  char opts[256];
+
+  // the unit is needed to size the stripes before opening them
+  if(colon == NULL || (size_t)(colon - rest) >= sizeof(opts)){
+    fprintf(stderr, "blockstore: bad stripe spec \"%s\"\n", rest);
+    exit(-1);
+  }
+  memcpy(opts, rest, colon - rest);
+  opts[colon - rest] = '\0';
+  g.nblocks = nblocks;
+  g.unit = spec_number(opts, "unit", 16);
+  if(g.unit < 1){
+    fprintf(stderr, "blockstore: stripe unit must be positive\n");
+    exit(-1);
+  }
+  ss->nstripes = open_children("stripe", rest, opts, sizeof(opts),
+                               ss->stripes, stripe_nblocks, &g, blocksize);
+  ss->base.ops = &stripe_ops;
+  ss->unit = g.unit;
+  child_pool_start(&ss->pool, spec_number(opts, "workers",
+                                          2 * ss->nstripes));
+  return &ss->base;
+}
+
+
+/*
+ * blockstore_open()
+ *
+ * Open the store described by spec (see blockstore.h).
+ */
+struct blockstore *blockstore_open(const char *spec, int nblocks,
+                                   int blocksize)
+{
+  struct blockstore *bs;
+  const char *opts = strchr(spec, ',');
+
+  if(strncmp(spec, "mirror:", 7) == 0 || strncmp(spec, "mirror,", 7) == 0){
+    bs = mirror_open(spec + 6, nblocks, blocksize);
+    opts = NULL; // any after the ':' belong to the children
+  }
+  else if(strncmp(spec, "stripe:", 7) == 0 || strncmp(spec, "stripe,", 7) == 0){
+    bs = stripe_open(spec + 6, nblocks, blocksize);
+    opts = NULL;
+  }
+  else if(strcmp(spec, "memory") == 0){
+    bs = memory_open("", nblocks, blocksize);
+  }
+  else if(strncmp(spec, "memory,", 7) == 0){
+    bs = memory_open(spec + 7, nblocks, blocksize);
+  }
+  else if(strncmp(spec, "uring:", 6) == 0){
+    bs = uring_open(spec + 6, nblocks, blocksize);
+  }
+  else if(strncmp(spec, "pread:", 6) == 0){
+    bs = pread_open(spec + 6, nblocks, blocksize);
+  }
+  else if(strncmp(spec, "mmap:", 5) == 0){
+    bs = mmap_open(spec + 5, nblocks, blocksize);
+  }
+  else{
+    fprintf(stderr, "blockstore: unknown store \"%s\"\n", spec);
+    exit(-1);
+  }
+  bs->nblocks = nblocks;
+  bs->blocksize = blocksize;
+  opts = opts ? opts + 1 : "";
+  bs->spike = spec_number(opts, "spike", 0);
+  bs->spikeodds = spec_number(opts, "spikeodds", 100);
+  if(bs->spikeodds < 1){
+    bs->spikeodds = 1;
+  }
+  return bs;
+}
+
+/*
+ * spike()
+ *
+ * Once every spikeodds accesses or so, stall for spike ns on top
+ * of whatever the store takes (see blockstore.h).
+ */
+static void spike(struct blockstore *bs)
+{
+  if(bs->spike > 0 && sthread_rng_below(sthread_rng(), bs->spikeodds) == 0){
+    sthread_sleep(bs->spike / 1000000000, bs->spike % 1000000000);
+  }
+}
+
+void blockstore_close(struct blockstore *bs)
+{
+  bs->ops->close(bs);
+}
+
+void blockstore_read(struct blockstore *bs, char *block, int blocknum)
+{
+  assert(blocknum >= 0 && blocknum < bs->nblocks);
+  bs->ops->read(bs, block, blocknum);
+  spike(bs);
+}
+
+void blockstore_write(struct blockstore *bs, const char *block, int blocknum)
+{
+  assert(blocknum >= 0 && blocknum < bs->nblocks);
+  bs->ops->write(bs, block, blocknum);
+  spike(bs);
+}
+
+void blockstore_load(struct blockstore *bs, const char *block, int blocknum)
+{
+  assert(blocknum >= 0 && blocknum < bs->nblocks);
+  if(bs->ops->load != NULL){
+    bs->ops->load(bs, block, blocknum);
+  }
+  else{
+    bs->ops->write(bs, block, blocknum);
+  }
+}
+
+int blockstore_async(struct blockstore *bs)
+{
+  return bs->ops->read_async != NULL;
+}
+
+void blockstore_read_async(struct blockstore *bs, char *block, int blocknum,
+                           void (*done)(void *), void *arg)
+{
+  assert(blocknum >= 0 && blocknum < bs->nblocks);
+  if(bs->ops->read_async != NULL){
+    bs->ops->read_async(bs, block, blocknum, done, arg);
+  }
+  else{
+    blockstore_read(bs, block, blocknum);
+    done(arg);
+  }
+}
+
+void blockstore_write_async(struct blockstore *bs, const char *block,
+                            int blocknum, void (*done)(void *), void *arg)
+{
+  assert(blocknum >= 0 && blocknum < bs->nblocks);
+  if(bs->ops->write_async != NULL){
+    bs->ops->write_async(bs, block, blocknum, done, arg);
+  }
+  else{
+    blockstore_write(bs, block, blocknum);
+    done(arg);
+  }
+}
+
+int blockstore_uring_stats(struct blockstore *bs, long *requests,
+                           long *enters)
+{
+  struct uring_store *us = (struct uring_store *)bs;
+
+  if(bs->ops != &uring_ops){
+    return 0;
+  }
+  smutex_lock(&us->lock);
+  *requests = us->requests;
+  *enters = us->enters;
+  smutex_unlock(&us->lock);
+  return 1;
+}
+
+void blockstore_hint(struct blockstore *bs, int blocknum, int count, int hint)
+{
+  if(count > bs->nblocks - blocknum){
+    count = bs->nblocks - blocknum;
+  }
+  if(bs->ops->hint != NULL && blocknum >= 0 && count > 0){
+    bs->ops->hint(bs, blocknum, count, hint);
+  }
+}
+
+void blockstore_readv(struct blockstore *bs, char *const *blocks,
+                      int blocknum, int count)
+{
+  int i;
+
+  assert(blocknum >= 0 && count >= 0 && blocknum + count <= bs->nblocks);
+  if(bs->ops->readv != NULL){
+    bs->ops->readv(bs, blocks, blocknum, count);
+    spike(bs);
+    return;
+  }
+  for(i = 0; i < count; i++){
+    blockstore_read(bs, blocks[i], blocknum + i);
+  }
+}
+
+void blockstore_writev(struct blockstore *bs, const char *const *blocks,
+                       int blocknum, int count)
+{
+  int i;
+
+  assert(blocknum >= 0 && count >= 0 && blocknum + count <= bs->nblocks);
+  if(bs->ops->writev != NULL){
+    bs->ops->writev(bs, blocks, blocknum, count);
+    spike(bs);
+    return;
+  }
+  for(i = 0; i < count; i++){
+    blockstore_write(bs, blocks[i], blocknum + i);
+  }
+}
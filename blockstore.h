@@ -0,0 +1,175 @@
+#ifndef _BLOCKSTORE_H_
+#define _BLOCKSTORE_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Backing stores for the simulated disk
+ *
+ * A block store holds nblocks blocks of blocksize bytes each; it is
+ * what dblockread()/dblockwrite() in cachetest.c end up calling.
+ * The kind of store is picked at open time by a spec string:
+ *
+ *   memory[,model=hdd|sata|nvme][,overhead=NS][,settle=NS]
+ *         [,stroke=NS][,bandwidth=B][,qdepth=N]
+ *       Blocks live in an array in RAM and every access sleeps
+ *       to simulate the disk; this is the default. Without a model
+ *       the sleep is a random 0-100us. With one it is the fixed
+ *       command overhead, plus for non-sequential accesses the
+ *       settle time and a seek of stroke ns scaled by the fraction
+ *       of the disk travelled, plus the transfer time at bandwidth
+ *       bytes/s; the device services qdepth requests at a time and
+ *       queues the rest. The model picks the defaults for the other
+ *       parameters: hdd is a 7200rpm disk, sata a SATA SSD and
+ *       nvme an NVMe SSD.
+ *
+ *   uring:PATH[,depth=N][,sqpoll]
+ *       Blocks live in the file or block device PATH (created and
+ *       sized if needed) and are read and written through an
+ *       io_uring with up to N requests in flight (default 64).
+ *       Submissions from concurrent callers are batched into one
+ *       io_uring_enter() call, the file and a pool of I/O buffers
+ *       are registered with the ring, and sqpoll has a kernel
+ *       thread poll the submission queue so that submitting
+ *       usually takes no system call at all. The asynchronous
+ *       calls return once the request is queued and a reaper
+ *       thread finishes it, so one caller can keep up to N
+ *       requests in flight.
+ *
+ *   pread:PATH[,direct][,buffers=N][,align=N]
+ *       Blocks live in PATH and are accessed with pread()/pwrite().
+ *       With direct the file is opened O_DIRECT, bypassing the
+ *       page cache; I/O then goes through a pool of N buffers
+ *       (default 64) aligned to the device's sector size, or to
+ *       align bytes (default 4096 for regular files). Blocks
+ *       smaller than a sector are written read-modify-write.
+ *
+ *   mmap:PATH[,advice=normal|random|sequential]
+ *       PATH is memory-mapped and reads and writes are plain loads
+ *       and stores, so the kernel's page cache does all the
+ *       caching and I/O. advice is passed to madvise() for the
+ *       whole mapping, and blockstore_hint() turns into
+ *       MADV_WILLNEED/MADV_DONTNEED on the blocks' pages.
+ *
+ *   mirror[,hedge=P][,floor=NS][,workers=N]:SPEC|SPEC[|SPEC...]
+ *       Every block is kept on each of the stores SPEC (at most 8).
+ *       Writes go to all of them. A read goes to one, and if it
+ *       takes longer than the P-th percentile of recent reads
+ *       (default 95, but at least floor ns, default 100us) it is
+ *       hedged: the next mirror is asked too and the first answer
+ *       wins. hedge=0 turns hedging off. N worker threads (default
+ *       16) carry out the requests.
+ *
+ *   stripe[,unit=N][,workers=N]:SPEC|SPEC[|SPEC...]
+ *       The blocks are striped over the stores SPEC (at most 8)
+ *       RAID-0 style, N blocks (default 16) at a time. Multi-block
+ *       requests (blockstore_readv()/writev()) are split by stripe
+ *       and the pieces done in parallel by N worker threads
+ *       (default two per stripe).
+ *
+ * Any store but mirror and stripe also takes spike=NS and
+ * spikeodds=N, which make about one access in N (default 100) stall
+ * for an extra NS, to inject latency spikes.
+ *
+ * All calls are thread safe. Errors are reported with perror()
+ * and exit the program, like the rest of the sthread code.
+ */
+struct blockstore;
+
+struct blockstore_ops {
+  void (*read)(struct blockstore *bs, char *block, int blocknum);
+  void (*write)(struct blockstore *bs, const char *block, int blocknum);
+  // like write, but without any simulated delay; may be NULL
+  void (*load)(struct blockstore *bs, const char *block, int blocknum);
+  void (*close)(struct blockstore *bs);
+  // see blockstore_hint(); may be NULL
+  void (*hint)(struct blockstore *bs, int blocknum, int count, int hint);
+  // see blockstore_readv()/writev(); may be NULL
+  void (*readv)(struct blockstore *bs, char *const *blocks, int blocknum,
+                int count);
+  void (*writev)(struct blockstore *bs, const char *const *blocks,
+                 int blocknum, int count);
+  // see blockstore_read_async()/write_async(); may be NULL
+  void (*read_async)(struct blockstore *bs, char *block, int blocknum,
+                     void (*done)(void *), void *arg);
+  void (*write_async)(struct blockstore *bs, const char *block, int blocknum,
+                      void (*done)(void *), void *arg);
+};
+
+struct blockstore {
+  const struct blockstore_ops *ops;
+  int nblocks;
+  int blocksize;
+  long long spike; // injected stall, ns
+  int spikeodds; // one access in this many stalls
+};
+
+struct blockstore *blockstore_open(const char *spec, int nblocks,
+                                   int blocksize);
+void blockstore_close(struct blockstore *bs);
+void blockstore_read(struct blockstore *bs, char *block, int blocknum);
+void blockstore_write(struct blockstore *bs, const char *block, int blocknum);
+
+/*
+ * Read or write the count consecutive blocks starting at blocknum
+ * as a single request, blocks[i] being the buffer for block
+ * blocknum + i. Stores that cannot do better fall back to one
+ * request per block.
+ */
+void blockstore_readv(struct blockstore *bs, char *const *blocks,
+                      int blocknum, int count);
+void blockstore_writev(struct blockstore *bs, const char *const *blocks,
+                       int blocknum, int count);
+
+/*
+ * Start a read or write of blocknum and return without waiting for
+ * it; done(arg) is called on one of the store's threads once it is
+ * complete, so it must not wait for anything that needs the store.
+ * A write has copied block by the time the call returns. Stores
+ * that cannot complete I/O by themselves (all but uring for now;
+ * blockstore_async() says which) do the access on the calling
+ * thread and call done before returning. Injected spikes only
+ * apply to the waiting calls.
+ */
+int blockstore_async(struct blockstore *bs);
+void blockstore_read_async(struct blockstore *bs, char *block, int blocknum,
+                           void (*done)(void *), void *arg);
+void blockstore_write_async(struct blockstore *bs, const char *block,
+                            int blocknum, void (*done)(void *), void *arg);
+
+/*
+ * Set the initial contents of a block. Same as blockstore_write(),
+ * except that simulated stores skip their artificial delay.
+ */
+void blockstore_load(struct blockstore *bs, const char *block, int blocknum);
+
+/*
+ * Tell the store about upcoming accesses to blocks
+ * [blocknum, blocknum + count): WILLNEED means they will be read
+ * soon (readahead), DONTNEED that they will not be read from the
+ * store for a while (e.g. because the cache now holds them).
+ * Purely advisory; stores that cannot use it ignore it.
+ */
+#define BLOCKSTORE_WILLNEED 1
+#define BLOCKSTORE_DONTNEED 2
+void blockstore_hint(struct blockstore *bs, int blocknum, int count, int hint);
+
+/*
+ * For a uring store, the requests it has queued and the
+ * io_uring_enter() calls it made to submit them (with sqpoll, to
+ * wake the polling thread); fewer calls than requests means
+ * concurrent submissions were batched. Returns 0 and leaves the
+ * counts alone for any other store.
+ */
+int blockstore_uring_stats(struct blockstore *bs, long *requests,
+                           long *enters);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif
@@ -1,46 +1,331 @@
 /*
   * cachetest.c -- Test implementation of multithreaded file cache
   *
-  * The disk has NBLOCKS of data; the cache stores many fewer.
-  * Our solution assumes a cache of size CACHESIZE.
+  * The disk has nBlocks of data; the cache stores many fewer.
+  * Our solution assumes a cache of size cacheSize.
+  *
+  * The compile-time settings below are defaults; most can also be
+  * set on the command line, see usage(). At the end of each run (or
+  * phase) a JSON summary is printed, or written to --json FILE.
   */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include "sthread.h"
+#include "blockstore.h"
+#include "iosched.h"
+#include "workload.h"
+#include "oplog.h"
+#include "hist.h"
+#include "perfctr.h"
 #include <stdbool.h>
 #include <math.h>
 #include <string.h>
+#include <getopt.h>
 
+#ifndef NTHREADS
 #define NTHREADS 10
+#endif
+#ifndef NTESTS
 #define NTESTS 10
+#endif
+#ifndef NBLOCKS
 #define NBLOCKS 100
+#endif
+#ifndef BLOCKSIZE
 #define BLOCKSIZE sizeof(int)
+#endif
+#ifndef CACHESIZE
+#define CACHESIZE 10
+#endif
+
+/* which cacheBlock a miss replaces: "lru" the least recently used,
+ * "fifo" the one filled longest ago, "random" any one */
+#ifndef POLICY
+#define POLICY "lru"
+#endif
+
+/* QUIET=1 (or --quiet) turns off the operation log, the "Read block"
+ * and "Wrote block" lines; otherwise the testers log each access to
+ * their own oplog.h ring and a drainer thread prints them, or with
+ * --log FILE writes the binary records for --dump to print later */
+#ifndef QUIET
+#define QUIET 0
+#endif
+
+/* with DURATION > 0 the testers run for that many seconds rather
+ * than NTESTS operations each */
+#ifndef DURATION
+#define DURATION 0
+#endif
+
+/* to simulate many more clients than we want OS threads, build
+ * with e.g. -DNGREEN=10000 to run that many testers as green
+ * threads on NCARRIERS OS threads instead of NTHREADS OS threads */
+#ifndef NGREEN
+#define NGREEN 0
+#endif
+#ifndef NCARRIERS
+#define NCARRIERS 2
+#endif
+
+/* with SIMULATE=1 the testers run as green threads (NGREEN of them,
+ * or NTHREADS if that is 0) in virtual time: disk delays advance a
+ * simulated clock instead of sleeping, so long runs take seconds */
+#ifndef SIMULATE
+#define SIMULATE 0
+#endif
+
+/* with ASYNC_DEPTH > 0 each tester keeps that many operations in
+ * flight through readblock_async/writeblock_async. Hits complete
+ * right away on the tester's thread, and so do misses on a uring
+ * store, whose I/O the store finishes. The misses left over (all of
+ * them on other stores) are served by NIOWORKERS cache I/O threads,
+ * which then cap the misses in progress */
+#ifndef ASYNC_DEPTH
+#define ASYNC_DEPTH 0
+#endif
+#ifndef NIOWORKERS
+#define NIOWORKERS 32
+#endif
+
+/* where the disk blocks live, see blockstore.h for the choices,
+ * e.g. -DBLOCKSTORE='"uring:/tmp/cachetest.disk,sqpoll"' */
+#ifndef BLOCKSTORE
+#define BLOCKSTORE "memory"
+#endif
+
+/* what the testers do, a workload.h profile with optional overrides,
+ * e.g. -DWORKLOAD='"b,theta=0.5"' or -DWORKLOAD='"e,scanlen=10"';
+ * the default is YCSB A, half reads and half updates over Zipf keys */
+#ifndef WORKLOAD
+#define WORKLOAD "a"
+#endif
+
+/* the workload generator's seed; tester n draws from stream n of it,
+ * so each tester's sequence of requests is the same on every run */
+#ifndef SEED
+#define SEED 0
+#endif
+
+/* with ARRIVAL_RATES the testers run open loop: rather than each
+ * starting an operation when its last one finishes, together they
+ * start them at the given rate (ops/s), with exponential (POISSON=1)
+ * or fixed inter-arrival times, and latency counts from when each
+ * operation should have started, so queueing delay is not hidden.
+ * A list, e.g. -DARRIVAL_RATES='"5000,10000,20000"', runs one phase
+ * per rate to sweep the offered load; not with ASYNC_DEPTH */
+#ifndef ARRIVAL_RATES
+#define ARRIVAL_RATES ""
+#endif
+#ifndef POISSON
+#define POISSON 1
+#endif
+
+/* how to schedule misses and write-backs on the store, "none" to
+ * call it directly or an iosched.h spec, e.g. -DIOSCHED='"deadline,readfirst"' */
+#ifndef IOSCHED
+#define IOSCHED "none"
+#endif
+
+/* build with -DCACHEBYPASS=1 to send every readblock/writeblock
+ * straight to the store, e.g. to compare our cache against the
+ * kernel's page cache with BLOCKSTORE "mmap:..." */
+#ifndef CACHEBYPASS
+#define CACHEBYPASS 0
+#endif
+
+/* after two read misses on consecutive blocks, hint that the next
+ * READAHEAD blocks will be wanted too (0 turns readahead off) */
+#ifndef READAHEAD
+#define READAHEAD 8
+#endif
+
+/* with COALESCE_WINDOW > 0 a read miss waits that many ns for
+ * misses on neighbouring blocks, and up to COALESCE_MAX of them
+ * are read from the disk with a single request */
+#ifndef COALESCE_WINDOW
+#define COALESCE_WINDOW 0
+#endif
+#ifndef COALESCE_MAX
+#define COALESCE_MAX 16
+#endif
+
+/* PERF_COUNTERS=1 (or --perf) counts perfctr.h hardware events on
+ * each tester's OS thread (with green testers, on the carriers) and
+ * reports them per operation after each phase; events the machine
+ * does not have show as n/a.  The threads already running when a
+ * phase starts (the cache I/O pool, the store's workers, but also
+ * idle pools and the op log's drainer) are counted too and reported
+ * on their own line, so they do not blur the testers' figures */
+#ifndef PERF_COUNTERS
+#define PERF_COUNTERS 0
+#endif
 
+/* an asynchronous cache request, handed back as its own completion */
+struct cacheRequest {
+  struct cacheClient *client; // whose completion queue to post to
+  char *block; // buffer to read into or write from
+  int blocknum; // block to read or write
+  bool write; // writeblock if true, readblock otherwise
+  long tag; // caller's cookie, returned with the completion
+  int slot; // the cache's own: the cacheBlock a miss is loading
+  long long start; // and when it was submitted
+};
+
+/* what the cache has done so far, see cache_stats() */
+struct cache_stats {
+  long hits; // accesses that found their block cached
+  long misses; // accesses that had to bring it in
+  long evictions; // misses that replaced another block
+  long writebacks; // dirty blocks written to disk, evicted or flushed
+  long coalesced; // read misses that joined another miss's disk read
+};
+
+/* a client of the asynchronous cache routines */
+struct cacheClient {
+  squeue_t completions; // finished cacheRequests
+  int outstanding; // submitted but not yet reaped
+};
+
+/* latency histograms recorded by one OS thread (green threads use
+ * their carrier's), merged with the other threads' at report time */
+struct threadHists {
+  struct hist ops; // tester operations this phase
+  struct hist access[2][2]; // readblock/writeblock, [write][miss]
+  struct threadHists *next;
+};
+
+static void usage(const char *prog);
+static void logop(int thread, bool write, int blocknum, const char *block);
+static void printrecord(const struct oplog_record *, void *);
+static void writerecord(const struct oplog_record *, void *);
+static void dumplog(const char *path);
 static void tester(int n);
+static void recordop(int kind, long long start);
+static struct threadHists *threadhists();
+static void mergehists(struct hist *ops, struct hist access[2][2]);
+static bool running(int done, long long start);
+static long runphase(int ngreen, double rate);
+static void reportops(long long elapsed, const struct hist *);
+static void perfbegin(struct perfctr *, bool inherit);
+static void perfend(struct perfctr *, bool other);
+static void reportperf();
+static void reportperfline(const char *label, bool other);
+static void reportjsonperf(const char *key, bool other, long done);
+static void jsonstring(const char *key, const char *str);
+static long opsdone();
+static void reportjson(long long elapsed, const struct cache_stats *,
+                       const struct hist *);
+static void reportstats();
+static void reportaccess();
+static void reportiosched();
+static void reportstore();
+static void missread(char *, int);
+static void reportcoalesce();
+static void reportlocks();
+static void speedup();
+static long addFlushed(long, long);
+static int comparewait(const void *, const void *);
+static void asyncTester(int n);
 static void cacheinit();
+static long cacheflush();
+static void cache_stats(struct cache_stats *);
 static void readblock(char *, int);
 static void writeblock(char *, int);
+static bool cacheread(char *, int);
+static bool cachewrite(char *, int);
+static void cacheasyncinit(int nworkers, int depth);
+static void cacheasyncfinish();
+static void cacheclientinit(struct cacheClient *, int);
+static void cacheclientdestroy(struct cacheClient *);
+static void readblock_async(struct cacheClient *, char *, int, long);
+static void writeblock_async(struct cacheClient *, char *, int, long);
+static bool cachepoll(struct cacheClient *, struct cacheRequest *);
+static void cachewait(struct cacheClient *, struct cacheRequest *);
+
+/* the run's settings, see usage() */
+static int nThreads = NTHREADS;
+static long nTests = NTESTS;
+static int nBlocks = NBLOCKS;
+static int cacheSize = CACHESIZE;
+static int blockSize = BLOCKSIZE;
+static const char *policyName = POLICY;
+static const char *workloadSpec = WORKLOAD;
+static const char *storeSpec = BLOCKSTORE;
+static const char *arrivalRates = ARRIVAL_RATES;
+static double duration = DURATION; // seconds, 0 to run nTests each
+static unsigned long long seed = SEED;
+static FILE *jsonOut;
+static bool quiet = QUIET;
+static const char *logPath; // binary operation log, NULL to print it
+static bool perfCounters = PERF_COUNTERS;
+
+/* where the testers log their accesses, NULL if quiet */
+static struct oplog *opLog;
+static FILE *logFile;
 
 /* the data being stored and fetched */
-static char blockData[NBLOCKS][BLOCKSIZE];
+static struct blockstore *disk;
+static struct blockstore *store; // disk without the I/O scheduler
+
+/* the testers' request streams */
+static struct workload *testWorkload;
+
+/* completed tester operations and their summed latency in ns,
+ * by WORKLOAD_READ... kind */
+static long opsDone[WORKLOAD_NOPS];
+static long long opsLatency[WORKLOAD_NOPS];
+
+/* this phase's hardware event counts, summed over the threads that
+ * could count each event, see perfbegin(); [0] is the testers',
+ * [1] the other threads', see PERF_COUNTERS */
+static long long perfTotals[2][PERFCTR_NEVENTS];
+static int perfThreads[2][PERFCTR_NEVENTS];
+
+/* every thread's histograms, see threadhists() */
+static __thread struct threadHists *myHists;
+static struct threadHists *allHists;
+static smutex_t histsMutex; // protects allHists
+
+/* the counters behind cache_stats(), sharded so that counting adds
+ * no shared writes to the hot path */
+static scounter_t statHits;
+static scounter_t statMisses;
+static scounter_t statEvictions;
+static scounter_t statWritebacks;
+static scounter_t statCoalesced;
+
+/* the current phase: how many testers, their combined open loop
+ * rate in ops/s (0 for closed loop) and when they were started */
+static int nTesters;
+static double arrivalRate;
+static long long phaseStart;
 
 /* cache data */
 #define INVALID -1  // the blocknum of empty cache blocks
-#define CACHESIZE 10 // cache size
+
+#define POLICY_LRU 0
+#define POLICY_FIFO 1
+#define POLICY_RANDOM 2
+static int cachePolicy; // POLICY_LRU...
 
 struct cacheBlock {
   // a single block of cache
   smutex_t mutex; // mutex for this block
   int blocknum; // blocknumber of this block
+  int loading; // block a miss is bringing in here, or INVALID
   bool dirty; // whether this block is dirty
-  char block[BLOCKSIZE]; // the actual data of this block
+  char *block; // the actual data of this block, blockSize bytes
 };
 
-static struct cacheBlock cache[CACHESIZE];
-// the cache is an array of CACHESIZE cacheBlocks
+static struct cacheBlock *cache;
+// the cache is an array of cacheSize cacheBlocks
 
-static int orderArray[CACHESIZE];
+static int *orderArray;
+// LRU uses by cachetryhit that could not reorder at once, by cacheBlock;
+// set with orderCount >= 0, applied by whoever next reorders
+static bool *touched;
 // holds indices of blocks in cacheBlock
 // when a block needs to be put in, it replaces block at index at front of this
 // when a block is initialized/reused, its index is put at the end of orderArray
@@ -54,99 +339,1113 @@ static scond_t orderCountZero; // signals that orderCount is 0
 static scond_t orderCountNonnegative; // signals that orderCount is >= 0
 static smutex_t orderCountMutex;
 
+static smutex_t missMutex; // protects the loading fields and writeBacks
+static scond_t slotLoaded; // signals that some loading or writeBack cleared
+
+/* evicted dirty blocks an asynchronous miss is still writing to disk;
+ * a miss on one of them must not read it before the write is done */
+struct writeBack {
+  int blocknum;
+  struct writeBack *next;
+};
+static struct writeBack *writeBacks;
+
 //static smutex_t orderArrayMutex;
 // mutex to make sure orderArray reassignment is atomic
 
-/* randomblock 
- * Generate a random block # from 0..NBLOCKS-1, according to a zipf 
- * distribution, using the rejection method.  The C library random() gives
- * us a uniform distribution, and we discard each option with probability 
- * 1-1/blocknum */
-int randomblock() {
-  int candidate;
+/* run nTests operations (or for duration) from the workload */
+void tester(int n) {
+  int i, j, blocknum;
+  char *block = malloc(blockSize);
+  long long start, now;
+  struct workload_client client; // this tester's own request stream
+  struct workload_op op;
+  sthread_rng_t arrivals; // open loop inter-arrival times
+  double gap = arrivalRate > 0 ? nTesters * 1e9 / arrivalRate : 0; // mean, ns
+  struct perfctr counters;
+  bool green = sgreen_current(); // then runphase counts the carriers
 
-  for (;;) {
-    candidate = rand() % NBLOCKS;
-    if ((double) rand()/RAND_MAX < (double) 1/(candidate + 1)) {
-      return candidate;
+  if (!green) {
+    perfbegin(&counters, false);
+  }
+  workload_client_init(testWorkload, &client, seed, n);
+  sthread_rng_seed(&arrivals, seed + 1, n);
+  /* spread fixed arrivals evenly over the testers */
+  start = phaseStart + (POISSON ? 0 : (long long)(gap * n / nTesters));
+  for (i = 0; ; i++) {
+    if (arrivalRate > 0) { /* wait for the operation's intended start */
+      start += POISSON ? -log(1 - sthread_rng_double(&arrivals)) * gap : gap;
+    }
+    if (!running(i, arrivalRate > 0 ? start : sthread_now_ns())) {
+      break;
+    }
+    workload_next(testWorkload, &client, &op);
+    if (arrivalRate > 0) {
+      now = sthread_now_ns();
+      if (start > now) {
+        sthread_sleep((start - now) / 1000000000, (start - now) % 1000000000);
+      }
+    }
+    else {
+      start = sthread_now_ns();
+    }
+    for (j = 0; j < op.count; j++) { /* a scan reads op.count blocks */
+      blocknum = (op.blocknum + j) % nBlocks;
+      if (op.kind != WORKLOAD_UPDATE && op.kind != WORKLOAD_INSERT) {
+        readblock(block, blocknum);
+        logop(n, false, blocknum, block);
+      }
+      if (op.kind == WORKLOAD_UPDATE || op.kind == WORKLOAD_INSERT ||
+          op.kind == WORKLOAD_RMW) {
+        *(int *)block = n * nBlocks + blocknum;
+        writeblock(block, blocknum); /* write the new value */
+        logop(n, true, blocknum, block);
+      }
     }
+    recordop(op.kind, start);
+  }
+  if (!green) {
+    perfend(&counters, false);
   }
+  free(block);
+  sthread_exit(100 + n);
+  // Not reached
 }
 
-/* read/write 100 blocks, randomly distributed */
-void tester(int n) {
-  int i, blocknum;
-  char block[BLOCKSIZE];
-
-  for (i = 0; i < NTESTS; i++) {
-    blocknum = randomblock();
-    if (rand() % 2) { /* if odd, simulate a write */
-      *(int *)block = n * NBLOCKS + blocknum;
-      writeblock(block, blocknum); /* write the new value */
-      printf("Wrote block %2d in thread %d: %3d\n", blocknum, n, *(int *)block);
-      /*printf("\tCache: ");
-      int x;
-      for (x = 0; x < CACHESIZE; x++) {
-        printf("[%d] = #%2d = %3d\t", orderArray[x], cache[orderArray[x]].blocknum, *(int *)cache[orderArray[x]].block);
+/* print the cache's counters for the whole run */
+void reportstats() {
+  struct cache_stats st;
+  long accesses;
+
+  cache_stats(&st);
+  accesses = st.hits + st.misses;
+  if (accesses > 0) {
+    printf("Cache: %ld hits, %ld misses (hit ratio %.1f%%), %ld evictions, "
+           "%ld write-backs, %ld coalesced misses\n", st.hits, st.misses,
+           100.0 * st.hits / accesses, st.evictions, st.writebacks,
+           st.coalesced);
+  }
+}
+
+/* print how many system calls a uring store needed to submit */
+void reportstore() {
+  long requests, enters;
+
+  if (blockstore_uring_stats(store, &requests, &enters) && requests > 0) {
+    printf("io_uring: %ld requests submitted in %ld io_uring_enter calls "
+           "(%.2f per call)\n", requests, enters,
+           enters > 0 ? (double)requests / enters : 0.0);
+  }
+}
+
+/* print what the I/O scheduler saw */
+void reportiosched() {
+  struct iosched_stats st;
+  const char *dir[2] = { "reads", "writes" };
+  int i;
+
+  iosched_stats(disk, &st);
+  for (i = 0; i < 2; i++) {
+    if (st.requests[i] > 0) {
+      printf("I/O scheduler: %ld %s in %ld dispatches, wait mean %.1f us max %.1f us\n",
+             st.requests[i], dir[i], st.dispatches[i],
+             st.wait_ns[i] / 1e3 / st.requests[i], st.max_wait_ns[i] / 1e3);
+    }
+  }
+  if (st.requests[0] + st.requests[1] > 0) {
+    printf("I/O scheduler: queue depth mean %.2f max %d\n",
+           (double)st.depth_sum / (st.requests[0] + st.requests[1]),
+           st.max_depth);
+  }
+}
+
+/* log an access by tester thread, without stdio or locks */
+void logop(int thread, bool write, int blocknum, const char *block) {
+  struct oplog_record r;
+
+  if (opLog != NULL) {
+    r.when = sthread_now_ns();
+    r.thread = thread;
+    r.blocknum = blocknum;
+    r.value = *(const int *)block;
+    r.write = write;
+    oplog_write(opLog, thread, &r);
+  }
+}
+
+/* oplog sinks, run on the drainer thread: print the record as the
+ * operation log line, or append it to logFile as is */
+void printrecord(const struct oplog_record *r, void *unused) {
+  printf("%s block %2d in thread %d: %3d\n", r->write ? "Wrote" : "Read ",
+         r->blocknum, r->thread, r->value);
+}
+void writerecord(const struct oplog_record *r, void *unused) {
+  if (fwrite(r, sizeof(*r), 1, logFile) != 1) {
+    perror("operation log write failed");
+    exit(-1);
+  }
+}
+
+/* print the binary operation log at path and exit */
+void dumplog(const char *path) {
+  struct oplog_record r;
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) {
+    perror(path);
+    exit(-1);
+  }
+  while (fread(&r, sizeof(r), 1, f) == 1) {
+    printf("%lld ", r.when);
+    printrecord(&r, NULL);
+  }
+  fclose(f);
+  exit(0);
+}
+
+/* whether a tester that has done done operations should start
+ * another at start */
+bool running(int done, long long start) {
+  if (duration > 0) {
+    return start < phaseStart + (long long)(duration * 1e9);
+  }
+  return done < nTests;
+}
+
+/* print the throughput and latency of the tester operations that
+ * took elapsed ns, overall and by kind, the same for every workload */
+void reportops(long long elapsed, const struct hist *latencies) {
+  double secs = elapsed / 1e9;
+  long done = 0;
+  long long latency = 0;
+  int kind;
+
+  for (kind = 0; kind < WORKLOAD_NOPS; kind++) {
+    done += opsDone[kind];
+    latency += opsLatency[kind];
+  }
+  if (done == 0) {
+    return;
+  }
+  if (arrivalRate > 0) {
+    printf("Offered %.0f ops/s (%s arrivals): ", arrivalRate,
+           POISSON ? "Poisson" : "fixed");
+  }
+  printf("%ld %s operations in %.3f %ss: %.0f ops/s, mean latency %.1f us, "
+         "p99 %.1f us\n", done, workload_name(testWorkload), secs,
+         SIMULATE ? "simulated " : "", done / secs, latency / 1e3 / done,
+         hist_percentile(latencies, 99) / 1e3);
+  for (kind = 0; kind < WORKLOAD_NOPS; kind++) {
+    printf("  %-6s %6ld ops (%5.1f%%), mean latency %.1f us\n",
+           workload_op_name(kind), opsDone[kind], 100.0 * opsDone[kind] / done,
+           opsDone[kind] > 0 ? opsLatency[kind] / 1e3 / opsDone[kind] : 0.0);
+  }
+}
+
+/* start counting hardware events on the calling thread if asked
+ * to, and with inherit on the threads it goes on to create */
+void perfbegin(struct perfctr *counters, bool inherit) {
+  if (perfCounters) {
+    perfctr_open(counters, inherit);
+  }
+}
+
+/* add counters' counts since they were opened to the phase's, to
+ * the other threads' if other */
+void perfend(struct perfctr *counters, bool other) {
+  long long counts[PERFCTR_NEVENTS];
+  int e;
+
+  if (!perfCounters) {
+    return;
+  }
+  perfctr_read(counters, counts);
+  perfctr_close(counters);
+  for (e = 0; e < PERFCTR_NEVENTS; e++) {
+    if (counts[e] >= 0) {
+      __atomic_add_fetch(&perfTotals[other][e], counts[e], __ATOMIC_RELAXED);
+      __atomic_add_fetch(&perfThreads[other][e], 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* completed tester operations this phase */
+long opsdone() {
+  long done = 0;
+  int kind;
+
+  for (kind = 0; kind < WORKLOAD_NOPS; kind++) {
+    done += opsDone[kind];
+  }
+  return done;
+}
+
+/* print the phase's hardware event counts per tester operation,
+ * the testers' and the other threads' apart */
+void reportperf() {
+  if (!perfCounters || opsdone() == 0) {
+    return;
+  }
+  reportperfline("Per operation:", false);
+  reportperfline("Other threads per operation:", true);
+}
+
+/* print the testers' (or the other threads') counts per operation */
+void reportperfline(const char *label, bool other) {
+  long long *totals = perfTotals[other];
+  int *threads = perfThreads[other];
+  long done = opsdone();
+  int e;
+
+  printf("%s", label);
+  for (e = 0; e < PERFCTR_NEVENTS; e++) {
+    if (threads[e] > 0) {
+      printf(" %s %.1f", perfctr_name(e), (double)totals[e] / done);
+    }
+    else {
+      printf(" %s n/a", perfctr_name(e));
+    }
+  }
+  if (threads[PERFCTR_CYCLES] > 0 && threads[PERFCTR_INSTRUCTIONS] > 0 &&
+      totals[PERFCTR_CYCLES] > 0) {
+    printf(" (IPC %.2f)", (double)totals[PERFCTR_INSTRUCTIONS] /
+           totals[PERFCTR_CYCLES]);
+  }
+  printf("\n");
+}
+
+/* print the run's settings and results as one line of JSON */
+void reportjson(long long elapsed, const struct cache_stats *st,
+                const struct hist *latencies) {
+  long done = opsdone(), accesses = st->hits + st->misses;
+
+  fprintf(jsonOut, "{");
+  jsonstring("workload", workloadSpec);
+  jsonstring("policy", policyName);
+  jsonstring("store", storeSpec);
+  fprintf(jsonOut, "\"threads\": %d, \"ops\": %ld, "
+          "\"nblocks\": %d, \"cache_size\": %d, \"block_size\": %d, "
+          "\"duration\": %g, \"offered_rate\": %g, \"simulated\": %s, ",
+          nTesters, nTests, nBlocks, cacheSize, blockSize, duration,
+          arrivalRate, SIMULATE ? "true" : "false");
+  fprintf(jsonOut, "\"elapsed_s\": %.6f, \"completed\": %ld, "
+          "\"ops_per_sec\": %.1f, \"hits\": %ld, \"misses\": %ld, "
+          "\"hit_ratio\": %.4f, \"evictions\": %ld, \"writebacks\": %ld, "
+          "\"coalesced_misses\": %ld, ",
+          elapsed / 1e9, done, done > 0 ? done / (elapsed / 1e9) : 0.0,
+          st->hits, st->misses,
+          accesses > 0 ? (double)st->hits / accesses : 0.0, st->evictions,
+          st->writebacks, st->coalesced);
+  if (perfCounters) {
+    reportjsonperf("per_op", false, done);
+    reportjsonperf("others_per_op", true, done);
+  }
+  if (latencies->count > 0) {
+    fprintf(jsonOut, "\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, "
+            "\"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}}\n",
+            hist_percentile(latencies, 50) / 1e3,
+            hist_percentile(latencies, 90) / 1e3,
+            hist_percentile(latencies, 99) / 1e3,
+            hist_percentile(latencies, 99.9) / 1e3,
+            hist_percentile(latencies, 100) / 1e3);
+  }
+  else {
+    fprintf(jsonOut, "\"latency_us\": null}\n");
+  }
+  fflush(jsonOut);
+}
+
+/* print str as the JSON member key, escaping what JSON strings
+ * cannot hold as is */
+void jsonstring(const char *key, const char *str) {
+  const unsigned char *c;
+
+  fprintf(jsonOut, "\"%s\": \"", key);
+  for (c = (const unsigned char *)str; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(jsonOut, "\\%c", *c);
+    }
+    else if (*c < 0x20) {
+      fprintf(jsonOut, "\\u%04x", *c);
+    }
+    else {
+      fputc(*c, jsonOut);
+    }
+  }
+  fprintf(jsonOut, "\", ");
+}
+
+/* print the testers' (or the other threads') counts per operation
+ * as the JSON member key */
+void reportjsonperf(const char *key, bool other, long done) {
+  int e;
+
+  fprintf(jsonOut, "\"%s\": {", key);
+  for (e = 0; e < PERFCTR_NEVENTS; e++) {
+    fprintf(jsonOut, e > 0 ? ", \"%s\": " : "\"%s\": ", perfctr_name(e));
+    if (perfThreads[other][e] > 0 && done > 0) {
+      fprintf(jsonOut, "%.1f", (double)perfTotals[other][e] / done);
+    }
+    else {
+      fprintf(jsonOut, "null");
+    }
+  }
+  fprintf(jsonOut, "}, ");
+}
+
+/* count an operation of the given kind that started at start as done */
+void recordop(int kind, long long start) {
+  long long latency = sthread_now_ns() - start;
+
+  __atomic_add_fetch(&opsLatency[kind], latency, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&opsDone[kind], 1, __ATOMIC_RELAXED);
+  hist_record(&threadhists()->ops, latency);
+}
+
+/* the calling thread's histograms, made on its first call; a green
+ * thread gets its carrier's. smutex_lock() may park a green thread
+ * and resume it on another carrier, which may have histograms by
+ * then, so myHists is looked at again under the lock */
+struct threadHists *threadhists() {
+  struct threadHists *h = myHists;
+
+  if (h == NULL) {
+    h = malloc(sizeof(*h));
+    if (h == NULL) {
+      perror("histogram allocation failed");
+      exit(-1);
+    }
+    hist_init(&h->ops);
+    hist_init(&h->access[0][0]);
+    hist_init(&h->access[0][1]);
+    hist_init(&h->access[1][0]);
+    hist_init(&h->access[1][1]);
+    smutex_lock(&histsMutex);
+    if (myHists == NULL) {
+      h->next = allHists;
+      allHists = h;
+      myHists = h;
+    }
+    else { // made by another green thread on this carrier
+      free(h);
+      h = myHists;
+    }
+    smutex_unlock(&histsMutex);
+  }
+  return h;
+}
+
+/* merge every thread's histograms into ops and access, either of
+ * which may be NULL; only meaningful while nobody is recording */
+void mergehists(struct hist *ops, struct hist access[2][2]) {
+  struct threadHists *h;
+  int w, m;
+
+  smutex_lock(&histsMutex);
+  for (h = allHists; h != NULL; h = h->next) {
+    if (ops != NULL) {
+      hist_merge(ops, &h->ops);
+    }
+    for (w = 0; access != NULL && w < 2; w++) {
+      for (m = 0; m < 2; m++) {
+        hist_merge(&access[w][m], &h->access[w][m]);
+      }
+    }
+  }
+  smutex_unlock(&histsMutex);
+}
+
+/* print the readblock/writeblock latency percentiles, hits and
+ * misses apart, over the whole run */
+void reportaccess() {
+  static struct hist access[2][2];
+  const char *name[2] = { "readblock", "writeblock" };
+  int w, m;
+
+  for (w = 0; w < 2; w++) {
+    for (m = 0; m < 2; m++) {
+      hist_init(&access[w][m]);
+    }
+  }
+  mergehists(NULL, access);
+  for (w = 0; w < 2; w++) {
+    for (m = 0; m < 2; m++) {
+      struct hist *h = &access[w][m];
+
+      if (h->count > 0) {
+        printf("%-10s %-6s %7lld, latency us p50 %.1f p90 %.1f p99 %.1f "
+               "p99.9 %.1f max %.1f\n", name[w], m ? "misses" : "hits",
+               h->count, hist_percentile(h, 50) / 1e3,
+               hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+               hist_percentile(h, 99.9) / 1e3, hist_percentile(h, 100) / 1e3);
       }
-      printf("\n");*/
     }
+  }
+}
+
+/* same workload as tester, but with up to ASYNC_DEPTH operations
+ * in flight at once, each with its own buffer (its tag is the index) */
+void asyncTester(int n) {
+  int i, blocknum, issued = 0;
+  char *blocks[ASYNC_DEPTH];
+  int freeSlots[ASYNC_DEPTH]; // stack of buffers not in flight
+  int nfree = ASYNC_DEPTH;
+  struct cacheClient client;
+  struct cacheRequest done;
+  struct workload_client wclient; // this tester's own request stream
+  struct workload_op op;
+  int step = 0, steps = 0; // accesses of op issued so far, and in all
+  bool modify[ASYNC_DEPTH]; // the buffer holds a read-modify-write's read
+  struct {
+    int kind;
+    int left; // accesses not yet completed
+    long long start;
+  } ops[ASYNC_DEPTH]; // operations in flight, at most one per buffer
+  int opOf[ASYNC_DEPTH]; // the operation each buffer's access is for
+  int freeOps[ASYNC_DEPTH]; // stack of unused ops
+  int nfreeOps = ASYNC_DEPTH;
+  int cur = 0; // the operation being issued
+  struct perfctr counters;
 
-    else { /* if even, simulate a read */
-      readblock(block, blocknum); 
-      printf("Read  block %2d in thread %d: %3d\n", blocknum, n, *(int *)block);
-      /*printf("\tCache: ");
-      int x;
-      for (x = 0; x < CACHESIZE; x++) {
-        printf("[%d] = #%2d = %3d\t", orderArray[x], cache[orderArray[x]].blocknum, *(int *)cache[orderArray[x]].block);
+  perfbegin(&counters, false);
+  workload_client_init(testWorkload, &wclient, seed, n);
+  for (i = 0; i < ASYNC_DEPTH; i++) {
+    blocks[i] = malloc(blockSize);
+    freeSlots[i] = i;
+    freeOps[i] = i;
+  }
+  cacheclientinit(&client, ASYNC_DEPTH);
+
+  /* a scan's reads go in flight without waiting on each other; a
+   * read-modify-write's write goes out from its read's buffer once
+   * the read has completed */
+  while (running(issued, sthread_now_ns()) || step < steps ||
+         client.outstanding > 0) {
+    while ((running(issued, sthread_now_ns()) || step < steps) &&
+           nfree > 0) { /* fill up the window */
+      int slot = freeSlots[--nfree];
+      if (step == steps) { /* start the next operation */
+        workload_next(testWorkload, &wclient, &op);
+        steps = op.count;
+        step = 0;
+        issued++;
+        /* every other operation in flight holds a buffer, and one is
+         * free, so there is a spare op */
+        cur = freeOps[--nfreeOps];
+        ops[cur].kind = op.kind;
+        ops[cur].left = op.kind == WORKLOAD_RMW ? 2 : op.count;
+        ops[cur].start = sthread_now_ns();
+      }
+      blocknum = (op.blocknum + (op.kind == WORKLOAD_SCAN ? step : 0)) % nBlocks;
+      modify[slot] = op.kind == WORKLOAD_RMW;
+      opOf[slot] = cur;
+      if (op.kind == WORKLOAD_UPDATE || op.kind == WORKLOAD_INSERT) {
+        *(int *)blocks[slot] = n * nBlocks + blocknum;
+        writeblock_async(&client, blocks[slot], blocknum, slot);
+      }
+      else {
+        readblock_async(&client, blocks[slot], blocknum, slot);
       }
-      printf("\n");*/
+      step++;
     }
+
+    /* wait for one completion, then reap whatever else is done */
+    cachewait(&client, &done);
+    do {
+      logop(n, done.write, done.blocknum, done.block);
+      if (modify[done.tag]) { /* now write the new value */
+        modify[done.tag] = false;
+        *(int *)done.block = n * nBlocks + done.blocknum;
+        writeblock_async(&client, done.block, done.blocknum, done.tag);
+      }
+      else {
+        freeSlots[nfree++] = done.tag;
+      }
+      i = opOf[done.tag];
+      if (--ops[i].left == 0) { /* its last access */
+        recordop(ops[i].kind, ops[i].start);
+        freeOps[nfreeOps++] = i;
+      }
+    } while (cachepoll(&client, &done));
+  }
+
+  perfend(&counters, false);
+  cacheclientdestroy(&client);
+  for (i = 0; i < ASYNC_DEPTH; i++) {
+    free(blocks[i]);
   }
   sthread_exit(100 + n);
   // Not reached
 }
 
+/* print the command line flags and exit */
+void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -t, --threads N      testers (default %d)\n"
+          "  -n, --ops N          operations per tester (default %ld)\n"
+          "  -d, --duration SECS  run for SECS seconds instead of --ops\n"
+          "  -b, --nblocks N      blocks on the disk (default %d)\n"
+          "  -c, --cache N        blocks in the cache (default %d)\n"
+          "  -s, --blocksize N    bytes per block (default %d)\n"
+          "  -p, --policy P       lru, fifo or random (default %s)\n"
+          "  -w, --workload SPEC  see workload.h (default %s)\n"
+          "      --store SPEC     see blockstore.h (default %s)\n"
+          "      --rates R,...    open loop arrival rates to sweep, ops/s\n"
+          "      --seed N         workload seed (default %llu)\n"
+          "      --json FILE      write the JSON summary to FILE, not stdout\n"
+          "  -q, --quiet          no operation log\n"
+          "      --log FILE       write the operation log to FILE in binary\n"
+          "      --dump FILE      print a binary operation log and exit\n"
+          "      --perf           count hardware events per operation\n"
+          "      --speedup        time the parallel slot loops over --cache\n"
+          "                       slots at 1..N cores, then exit\n",
+          prog, nThreads, nTests, nBlocks, cacheSize, blockSize, policyName,
+          workloadSpec, storeSpec, seed);
+  exit(-1);
+}
+
 int main(int argc, char **argv) {
-  int i; 
+  int i, c; 
   long ret; 
-  sthread_t testers[NTHREADS];
+  int ngreen;
+  bool bench = false;
+  const char *rates;
+  char *end, *initial;
+  static const struct option options[] = {
+    { "threads", required_argument, NULL, 't' },
+    { "ops", required_argument, NULL, 'n' },
+    { "duration", required_argument, NULL, 'd' },
+    { "nblocks", required_argument, NULL, 'b' },
+    { "cache", required_argument, NULL, 'c' },
+    { "blocksize", required_argument, NULL, 's' },
+    { "policy", required_argument, NULL, 'p' },
+    { "workload", required_argument, NULL, 'w' },
+    { "store", required_argument, NULL, 'S' },
+    { "rates", required_argument, NULL, 'R' },
+    { "seed", required_argument, NULL, 'E' },
+    { "json", required_argument, NULL, 'J' },
+    { "quiet", no_argument, NULL, 'q' },
+    { "log", required_argument, NULL, 'L' },
+    { "dump", required_argument, NULL, 'D' },
+    { "perf", no_argument, NULL, 'P' },
+    { "speedup", no_argument, NULL, 'U' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  jsonOut = stdout;
+  while ((c = getopt_long(argc, argv, "t:n:d:b:c:s:p:w:qh", options, NULL)) != -1) {
+    switch (c) {
+    case 't': nThreads = atoi(optarg); break;
+    case 'n': nTests = atol(optarg); break;
+    case 'd': duration = atof(optarg); break;
+    case 'b': nBlocks = atoi(optarg); break;
+    case 'c': cacheSize = atoi(optarg); break;
+    case 's': blockSize = atoi(optarg); break;
+    case 'p': policyName = optarg; break;
+    case 'w': workloadSpec = optarg; break;
+    case 'S': storeSpec = optarg; break;
+    case 'R': arrivalRates = optarg; break;
+    case 'E': seed = strtoull(optarg, NULL, 0); break;
+    case 'q': quiet = true; break;
+    case 'L': logPath = optarg; break;
+    case 'D': dumplog(optarg); break;
+    case 'P': perfCounters = true; break;
+    case 'U': bench = true; break;
+    case 'J':
+      jsonOut = fopen(optarg, "a");
+      if (jsonOut == NULL) {
+        perror(optarg);
+        exit(-1);
+      }
+      break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind < argc || nThreads < 1 || nTests < 0 || duration < 0 ||
+      nBlocks < 1 || cacheSize < 1 || blockSize < (int)sizeof(int)) {
+    usage(argv[0]);
+  }
+  if (strcmp(policyName, "lru") == 0) {
+    cachePolicy = POLICY_LRU;
+  }
+  else if (strcmp(policyName, "fifo") == 0) {
+    cachePolicy = POLICY_FIFO;
+  }
+  else if (strcmp(policyName, "random") == 0) {
+    cachePolicy = POLICY_RANDOM;
+  }
+  else {
+    usage(argv[0]);
+  }
+  if (bench) {
+    speedup();
+    exit(0);
+  }
+  ngreen = NGREEN > 0 ? NGREEN : (SIMULATE ? nThreads : 0);
+  rates = arrivalRates;
+  if (!quiet) {
+    int nrings = ngreen > 0 ? ngreen : nThreads; // one per tester
+
+    if (logPath != NULL) {
+      logFile = fopen(logPath, "w");
+      if (logFile == NULL) {
+        perror(logPath);
+        exit(-1);
+      }
+    }
+    opLog = oplog_open(nrings, nrings < 64 ? 4096 : 256,
+                       logFile != NULL ? writerecord : printrecord, NULL);
+  }
+  smutex_init_named(&histsMutex, "histsMutex");
 
-  srand(0); /* init the workload generator */
+  testWorkload = workload_open(workloadSpec, nBlocks); /* init the workload generator */
+  disk = store = blockstore_open(storeSpec, nBlocks, blockSize); /* init the disk */
+  if (strcmp(IOSCHED, "none") != 0) {
+    disk = iosched_open(disk, IOSCHED);
+  }
   cacheinit(); /* init the buffer */
+  if (ASYNC_DEPTH > 0) {
+    cacheasyncinit(NIOWORKERS, nThreads * ASYNC_DEPTH);
+  }
 
   /* init blocks */
-  for (i = 0; i < NBLOCKS; i++) {
-    memcpy(blockData[i], (char *) &i, BLOCKSIZE);
+  initial = calloc(1, blockSize);
+  for (i = 0; i < nBlocks; i++) {
+    *(int *)initial = i;
+    blockstore_load(disk, initial, i);
   }
+  free(initial);
 
-  /* start the testers */
-  for(i = 0; i < NTHREADS; i++) {
-    sthread_create(&(testers[i]), &tester, i);
+  if (SIMULATE) {
+    sgreen_set_virtual(1);
   }
+  if (*rates == '\0') {
+    ret = runphase(ngreen, 0);
+  }
+  while (*rates != '\0') { /* one phase per rate */
+    double rate = strtod(rates, &end);
 
-  /* wait for everyone to finish */
-  for(i = 0; i < NTHREADS; i++) {
-    ret = sthread_join(testers[i]);
+    if (end == rates || rate <= 0 || (*end != ',' && *end != '\0') ||
+        ASYNC_DEPTH > 0) {
+      fprintf(stderr, "bad arrival rates \"%s\"\n", arrivalRates);
+      exit(-1);
+    }
+    ret = runphase(ngreen, rate);
+    rates = *end == ',' ? end + 1 : end;
   }
 
+  if (opLog != NULL) {
+    oplog_close(opLog);
+  }
+  if (logFile != NULL) {
+    fclose(logFile);
+  }
+  if (ASYNC_DEPTH > 0) {
+    cacheasyncfinish();
+  }
+  if (SIMULATE) {
+    sgreen_set_virtual(0); // the flush runs on ordinary threads
+  }
+  printf("Flushed %ld dirty blocks.\n", cacheflush());
+  reportstats();
+  reportaccess();
+  reportstore();
+  if (strcmp(IOSCHED, "none") != 0) {
+    reportiosched();
+  }
+  if (COALESCE_WINDOW > 0) {
+    reportcoalesce();
+  }
+  reportlocks();
+  blockstore_close(disk);
+  workload_close(testWorkload);
+  if (jsonOut != stdout) {
+    fclose(jsonOut);
+  }
   printf("Main thread done.\n");
   
   return ret;
 }
 
-/* simulated disk block routines
- * simulate out of order completion by the disk 
- * by sleeping for up to 100us */
+/* run the testers once, open loop at rate ops/s if rate > 0,
+ * and report how they did */
+long runphase(int ngreen, double rate) {
+  int i, kind;
+  long ret = 0;
+  long long elapsed;
+  sthread_t *testers = malloc(nThreads * sizeof(sthread_t));
+  struct cache_stats before, after;
+  struct hist *latencies = malloc(sizeof(struct hist));
+  struct threadHists *h;
+  struct perfctr counters;
+  struct perfctr *others = NULL; // the other threads, see PERF_COUNTERS
+  int nothers = 0;
+
+  nTesters = ngreen > 0 ? ngreen : nThreads;
+  arrivalRate = rate;
+  for (kind = 0; kind < WORKLOAD_NOPS; kind++) {
+    opsDone[kind] = 0;
+    opsLatency[kind] = 0;
+  }
+  memset(perfTotals, 0, sizeof(perfTotals));
+  memset(perfThreads, 0, sizeof(perfThreads));
+  smutex_lock(&histsMutex);
+  for (h = allHists; h != NULL; h = h->next) {
+    hist_init(&h->ops);
+  }
+  smutex_unlock(&histsMutex);
+  cache_stats(&before);
+  if (perfCounters) {
+    others = perfctr_open_others(&nothers);
+  }
+  phaseStart = sthread_now_ns();
+
+  if (ngreen > 0) {
+    sgreen_t *greens = malloc(ngreen * sizeof(sgreen_t));
+
+    /* start the testers, they all run inside sgreen_run */
+    for (i = 0; i < ngreen; i++) {
+      sgreen_create(&greens[i], &tester, i);
+    }
+    perfbegin(&counters, true); // this thread is a carrier too
+    sgreen_run(NCARRIERS);
+    perfend(&counters, false);
+
+    for (i = 0; i < ngreen; i++) {
+      ret = sgreen_join(greens[i]);
+    }
+    free(greens);
+  }
+
+  else {
+    /* start the testers */
+    for(i = 0; i < nThreads; i++) {
+      sthread_create(&(testers[i]), ASYNC_DEPTH > 0 ? &asyncTester : &tester, i);
+    }
+
+    /* wait for everyone to finish */
+    for(i = 0; i < nThreads; i++) {
+      ret = sthread_join(testers[i]);
+    }
+  }
+
+  elapsed = sthread_now_ns() - phaseStart;
+  for (i = 0; i < nothers; i++) {
+    perfend(&others[i], true);
+  }
+  free(others);
+  if (opLog != NULL) {
+    oplog_flush(opLog); // so the log comes before the summary
+  }
+  hist_init(latencies);
+  mergehists(latencies, NULL);
+  reportops(elapsed, latencies);
+  reportperf();
+  cache_stats(&after);
+  after.hits -= before.hits;
+  after.misses -= before.misses;
+  after.evictions -= before.evictions;
+  after.writebacks -= before.writebacks;
+  after.coalesced -= before.coalesced;
+  reportjson(elapsed, &after, latencies);
+  free(latencies);
+  free(testers);
+  return ret;
+}
+
+/* disk block routines
+ * the in-memory store simulates out of order completion by the disk
+ * by sleeping for up to 100us, file-backed stores do real I/O */
 void dblockread(char *block, int blocknum) {
   // copy from disk[blocknum] to block
-  memcpy(block, blockData[blocknum], BLOCKSIZE);
-  sthread_sleep(0, rand() % 100000); 
+  blockstore_read(disk, block, blocknum);
 }
 void dblockwrite(char *block, int blocknum) {
   // copy from block into disk[blocknum]
-  memcpy(blockData[blocknum], block, BLOCKSIZE);
-  sthread_sleep(0, rand() % 100000); 
+  blockstore_write(disk, block, blocknum);
+}
+void dblockhint(int blocknum, int count, int hint) {
+  // tell the store what we are about to do with these blocks
+  blockstore_hint(disk, blocknum, count, hint);
+}
+
+/* the last block readblock missed on, for spotting sequential runs */
+static int lastMiss = INVALID;
+
+/* read misses waiting to go to the disk together: blocks lo..hi,
+ * each with the cache buffer to fill and a flag to set when done */
+struct missBatch {
+  int lo, hi;
+  char *blocks[COALESCE_MAX]; // indexed by blocknum - lo
+  bool *done[COALESCE_MAX];
+  long long arrived[COALESCE_MAX]; // when each miss joined
+  struct missBatch *next;
+};
+
+static smutex_t coalesceMutex; // protects the fields below
+static scond_t coalesceDone; // signals that some batch was read
+static struct missBatch *openBatches; // still taking misses
+static long coalesceMisses; // read misses through missread
+static long coalesceReads; // disk reads they took
+static long long coalesceDelay; // total ns from miss to disk request
+
+// Reads a missed block, coalescing it with misses on neighbouring
+// blocks that arrive within COALESCE_WINDOW. The first miss of a
+// batch waits out the window and then reads the lot; the rest just
+// wait for it.
+void missread(char *block, int blocknum) {
+  struct missBatch batch, *b;
+  bool done = false;
+  long long start;
+  int i, n;
+
+  if (COALESCE_WINDOW <= 0) {
+    dblockread(block, blocknum);
+    return;
+  }
+
+  start = sthread_now_ns();
+  smutex_lock(&coalesceMutex);
+  coalesceMisses++;
+  for (b = openBatches; b != NULL; b = b->next) {
+    if (b->hi - b->lo + 1 < COALESCE_MAX &&
+        (blocknum == b->lo - 1 || blocknum == b->hi + 1)) {
+      break;
+    }
+  }
+
+  if (b != NULL) { // join a neighbour's batch
+    if (blocknum == b->lo - 1) {
+      n = b->hi - b->lo + 1;
+      memmove(b->blocks + 1, b->blocks, n * sizeof(b->blocks[0]));
+      memmove(b->done + 1, b->done, n * sizeof(b->done[0]));
+      memmove(b->arrived + 1, b->arrived, n * sizeof(b->arrived[0]));
+      b->lo--;
+    }
+    else {
+      b->hi++;
+    }
+    b->blocks[blocknum - b->lo] = block;
+    b->done[blocknum - b->lo] = &done;
+    b->arrived[blocknum - b->lo] = start;
+    scounter_add(&statCoalesced, 1);
+    while (!done) {
+      scond_wait(&coalesceDone, &coalesceMutex);
+    }
+    smutex_unlock(&coalesceMutex);
+    return;
+  }
+
+  // start a batch of our own and give the neighbours a chance
+  batch.lo = batch.hi = blocknum;
+  batch.blocks[0] = block;
+  batch.done[0] = &done;
+  batch.arrived[0] = start;
+  batch.next = openBatches;
+  openBatches = &batch;
+  smutex_unlock(&coalesceMutex);
+
+  sthread_sleep(0, COALESCE_WINDOW);
+
+  smutex_lock(&coalesceMutex);
+  for (b = openBatches; b != &batch; b = b->next) {
+    if (b->next == &batch) {
+      b->next = batch.next;
+      break;
+    }
+  }
+  if (openBatches == &batch) {
+    openBatches = batch.next;
+  }
+  n = batch.hi - batch.lo + 1;
+  coalesceReads++;
+  start = sthread_now_ns();
+  for (i = 0; i < n; i++) {
+    coalesceDelay += start - batch.arrived[i];
+  }
+  smutex_unlock(&coalesceMutex);
+
+  blockstore_readv(disk, batch.blocks, batch.lo, n);
+
+  smutex_lock(&coalesceMutex);
+  for (i = 0; i < n; i++) {
+    *batch.done[i] = true;
+  }
+  scond_broadcast(&coalesceDone, &coalesceMutex);
+  smutex_unlock(&coalesceMutex);
+}
+
+// Prints what coalescing bought and what it cost
+void reportcoalesce() {
+  if (coalesceMisses > 0) {
+    printf("Coalesced %ld read misses into %ld disk reads (%ld saved), window added %.1f us per miss\n",
+           coalesceMisses, coalesceReads, coalesceMisses - coalesceReads,
+           coalesceDelay / 1e3 / coalesceMisses);
+  }
+}
+
+// Orders lock statistics by most time spent waiting first
+int comparewait(const void *a, const void *b) {
+  const struct sthread_lock_stats *x = a, *y = b;
+
+  return (x->wait_ns < y->wait_ns) - (x->wait_ns > y->wait_ns);
+}
+
+/* print the lock profile when sthread was built with STHREAD_PROFILE,
+ * locks of the same name (e.g. the slot mutexes) added up */
+void reportlocks() {
+  struct sthread_lock_stats *st = malloc(STHREAD_PROFILE_LOCKS *
+                                         sizeof(*st));
+  int n = sthread_lock_stats(st, STHREAD_PROFILE_LOCKS);
+  int count[STHREAD_PROFILE_LOCKS];
+  int i, j, m = 0;
+
+  for (i = 0; i < n; i++) {
+    const char *name = st[i].name ? st[i].name : "(unnamed)";
+
+    for (j = 0; j < m; j++) {
+      if (st[j].cond == st[i].cond && strcmp(st[j].name, name) == 0) {
+        break;
+      }
+    }
+    if (j == m) { // first of its name
+      st[m] = st[i];
+      st[m].name = name;
+      count[m++] = st[i].locks;
+      continue;
+    }
+    st[j].acquisitions += st[i].acquisitions;
+    st[j].contended += st[i].contended;
+    st[j].wait_ns += st[i].wait_ns;
+    st[j].hold_ns += st[i].hold_ns;
+    if (st[i].max_wait_ns > st[j].max_wait_ns) {
+      st[j].max_wait_ns = st[i].max_wait_ns;
+    }
+    if (st[i].max_hold_ns > st[j].max_hold_ns) {
+      st[j].max_hold_ns = st[i].max_hold_ns;
+    }
+    count[j] += st[i].locks;
+  }
+  // keep each name's lock count with it through the sort
+  for (i = 0; i < m; i++) {
+    st[i].lock = &count[i];
+  }
+  qsort(st, m, sizeof(*st), comparewait);
+
+  for (i = 0; i < m; i++) {
+    int locks = *(const int *)st[i].lock;
+
+    if (st[i].acquisitions == 0) {
+      continue;
+    }
+    if (st[i].cond) {
+      printf("Cond  %-22s x%-4d %9ld waits, wait us total %.1f max %.1f\n",
+             st[i].name, locks, st[i].acquisitions, st[i].wait_ns / 1e3,
+             st[i].max_wait_ns / 1e3);
+    }
+    else {
+      printf("Mutex %-22s x%-4d %9ld locks, %.1f%% contended, wait us "
+             "total %.1f max %.1f, held us total %.1f max %.1f\n",
+             st[i].name, locks, st[i].acquisitions,
+             100.0 * st[i].contended / st[i].acquisitions,
+             st[i].wait_ns / 1e3, st[i].max_wait_ns / 1e3,
+             st[i].hold_ns / 1e3, st[i].max_hold_ns / 1e3);
+    }
+  }
+  free(st);
+}
+
+/* slot loop benchmark: the same work as initSlots and flushSlots,
+ * minus the mallocs and the disk writes, on a slot array of its own */
+static struct cacheBlock *benchSlots;
+static char *benchData;
+
+static void benchInit(long lo, long hi, void *unused) {
+  long i;
+
+  for (i = lo; i < hi; i++) {
+    smutex_init(&benchSlots[i].mutex);
+    benchSlots[i].blocknum = i;
+    benchSlots[i].loading = INVALID;
+    benchSlots[i].dirty = true;
+    benchSlots[i].block = benchData + i * blockSize;
+    memset(benchSlots[i].block, 0, blockSize);
+    *(int *)benchSlots[i].block = i;
+  }
+}
+
+static long benchFlush(long lo, long hi, void *unused) {
+  long i, flushed = 0;
+
+  for (i = lo; i < hi; i++) {
+    smutex_lock(&benchSlots[i].mutex);
+    if (benchSlots[i].dirty &&
+        *(int *)benchSlots[i].block == benchSlots[i].blocknum) {
+      benchSlots[i].dirty = false;
+      flushed++;
+    }
+    smutex_unlock(&benchSlots[i].mutex);
+  }
+  return flushed;
+}
+
+/* time sthread_parallel_for (initializing the slots) and
+ * sthread_parallel_reduce (flushing them) over cacheSize slots at
+ * 1..sthread_ncpus() cores, best of 3 runs each, and print each
+ * core count's speedup over one core; the slots' mutexes are
+ * destroyed, untimed, after each run */
+void speedup() {
+  int ncpus = sthread_ncpus(), cpus, rep, i;
+  long long t, best[2], base[2] = { 0, 0 };
+  long flushed;
+
+  benchSlots = malloc(cacheSize * sizeof(struct cacheBlock));
+  benchData = malloc((size_t)cacheSize * blockSize);
+  if (benchSlots == NULL || benchData == NULL) {
+    perror("slot allocation failed");
+    exit(-1);
+  }
+  printf("Slot loops over %d slots of %d bytes\n", cacheSize, blockSize);
+  printf("cores  parallel_for ms  speedup  parallel_reduce ms  speedup\n");
+  for (cpus = 1; cpus <= ncpus; cpus++) {
+    sthread_set_ncpus(cpus);
+    best[0] = best[1] = 0;
+    for (rep = 0; rep < 3; rep++) {
+      t = sthread_now_ns();
+      sthread_parallel_for(0, cacheSize, 0, benchInit, NULL);
+      t = sthread_now_ns() - t;
+      if (best[0] == 0 || t < best[0]) {
+        best[0] = t;
+      }
+      t = sthread_now_ns();
+      flushed = sthread_parallel_reduce(0, cacheSize, 0, benchFlush,
+                                        addFlushed, 0, NULL);
+      t = sthread_now_ns() - t;
+      if (best[1] == 0 || t < best[1]) {
+        best[1] = t;
+      }
+      if (flushed != cacheSize) {
+        fprintf(stderr, "parallel_reduce flushed %ld of %d slots\n",
+                flushed, cacheSize);
+        exit(-1);
+      }
+      for (i = 0; i < cacheSize; i++) { // benchInit inits them again
+        smutex_destroy(&benchSlots[i].mutex);
+      }
+    }
+    if (cpus == 1) {
+      base[0] = best[0];
+      base[1] = best[1];
+    }
+    printf("%5d  %15.3f  %7.2f  %18.3f  %7.2f\n", cpus, best[0] / 1e6,
+           (double)base[0] / best[0], best[1] / 1e6,
+           (double)base[1] / best[1]);
+  }
+  sthread_set_ncpus(0);
+  free(benchData);
+  free(benchSlots);
 }
 
 /* Cache routines */
@@ -160,47 +1459,240 @@ void putToEnd(int indexTemp) {
   int i; 
   int startPosition = 0; // from which place up do we reshuffle
 
-  for (i = 0; i < CACHESIZE; i++) { // look through the orderArray
+  for (i = 0; i < cacheSize; i++) { // look through the orderArray
     if (orderArray[i] == indexTemp) { // find indexTemp in orderArray
       startPosition = i; // this is the first place to reshuffle
     }
   }
 
-  for (i = startPosition; i < (CACHESIZE-1); i++) { // reshuffling
+  for (i = startPosition; i < (cacheSize-1); i++) { // reshuffling
     orderArray[i] = orderArray[i+1]; // move things up
   }
-  orderArray[CACHESIZE-1] = indexTemp; // put indexTemp at the end
+  orderArray[cacheSize-1] = indexTemp; // put indexTemp at the end
 }
 
-// Initializes the cache
-void cacheinit() {
-  scond_init(&orderCountZero);
-  scond_init(&orderCountNonnegative);
-  smutex_init(&orderCountMutex);
-
+// Moves the cacheBlocks cachetryhit touched to the end of the orderArray
+// orderArray must be protected, as for putToEnd
+static void putTouchedToEnd() {
   int i;
-  orderCount = 0; // make sure orderCount is initialized
 
-  for (i = 0; i < CACHESIZE; i++ ) { // initialize all cacheBlocks
-    smutex_init(&cache[i].mutex);
+  for (i = 0; i < cacheSize; i++) {
+    if (touched[i]) {
+      touched[i] = false;
+      putToEnd(i);
+    }
+  }
+}
+
+// Initializes cacheBlocks [lo, hi), run in parallel by cacheinit
+static void initSlots(long lo, long hi, void *unused) {
+  long i;
+
+  for (i = lo; i < hi; i++) { // initialize all cacheBlocks
+    smutex_init_named(&cache[i].mutex, "slot mutex");
     cache[i].dirty = false;
     cache[i].blocknum = INVALID;
-  }
-  
-  for (i = 0; i < CACHESIZE; i++) { // initialize orderArray with 0-CACHESIZE
+    cache[i].loading = INVALID;
+    cache[i].block = malloc(blockSize);
+    // initialize orderArray with 0-cacheSize
     // needs to be this way because we initially, we allocate stuff in order
     orderArray[i] = i;
   }
 }
 
-// Reads a block
+// Initializes the cache
+void cacheinit() {
+  scond_init_named(&orderCountZero, "orderCountZero");
+  scond_init_named(&orderCountNonnegative, "orderCountNonnegative");
+  smutex_init_named(&orderCountMutex, "orderCountMutex");
+  smutex_init_named(&missMutex, "missMutex");
+  scond_init_named(&slotLoaded, "slotLoaded");
+  smutex_init_named(&coalesceMutex, "coalesceMutex");
+  scond_init_named(&coalesceDone, "coalesceDone");
+
+  orderCount = 0; // make sure orderCount is initialized
+
+  scounter_init(&statHits);
+  scounter_init(&statMisses);
+  scounter_init(&statEvictions);
+  scounter_init(&statWritebacks);
+  scounter_init(&statCoalesced);
+
+  cache = malloc(cacheSize * sizeof(struct cacheBlock));
+  orderArray = malloc(cacheSize * sizeof(int));
+  touched = calloc(cacheSize, sizeof(bool));
+  if (cache == NULL || orderArray == NULL || touched == NULL) {
+    perror("cache allocation failed");
+    exit(-1);
+  }
+
+  sthread_parallel_for(0, cacheSize, 0, initSlots, NULL);
+}
+
+// Writes back dirty cacheBlocks [lo, hi), returns how many were written
+static long flushSlots(long lo, long hi, void *unused) {
+  long i, flushed = 0;
+
+  for (i = lo; i < hi; i++) {
+    smutex_lock(&cache[i].mutex);
+    if (cache[i].dirty) {
+      dblockwrite(cache[i].block, cache[i].blocknum);
+      cache[i].dirty = false;
+      flushed++;
+      scounter_add(&statWritebacks, 1);
+    }
+    smutex_unlock(&cache[i].mutex);
+  }
+  return flushed;
+}
+
+static long addFlushed(long a, long b) {
+  return a + b;
+}
+
+// Writes every dirty block back to disk, returns how many were written
+// the disk writes are slow, so the slots are spread over all cores
+long cacheflush() {
+  return sthread_parallel_reduce(0, cacheSize, 1, flushSlots, addFlushed,
+                                 0, NULL);
+}
+
+// Fills in what the cache has done since cacheinit, safe to call at
+// any time; the counts are summed from their shards as we go, so a
+// call made while testers run is a near-instant snapshot
+void cache_stats(struct cache_stats *st) {
+  st->hits = scounter_read(&statHits);
+  st->misses = scounter_read(&statMisses);
+  st->evictions = scounter_read(&statEvictions);
+  st->writebacks = scounter_read(&statWritebacks);
+  st->coalesced = scounter_read(&statCoalesced);
+}
+
+// Looks up blocknum in the cache, returns its index or -1
+static int findblock(int blocknum) {
+  int i;
+
+  for (i = 0; i < cacheSize; i++) {
+    if (cache[i].blocknum == blocknum) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Claims the cacheBlock a miss on blocknum should replace and returns
+// it locked, with loading set so no other miss picks it or loads
+// blocknum too. Returns -1 if blocknum turned out to be cached or
+// being loaded after all, the caller should then look it up again.
+// Concurrent misses get different cacheBlocks, so their disk reads
+// can overlap. Unless wait, it also returns -1 rather than wait for
+// another miss's disk I/O.
+static int claimblock(int blocknum, bool wait) {
+  int i, start, slot = -1;
+  struct writeBack *wb;
+
+  smutex_lock(&missMutex);
+  while (slot == -1) {
+    for (wb = writeBacks; wb != NULL && wb->blocknum != blocknum;
+         wb = wb->next) {
+    }
+    if (wb != NULL) { // its last contents are still on their way to disk
+      if (!wait) {
+        break;
+      }
+      scond_wait(&slotLoaded, &missMutex);
+      continue;
+    }
+    for (i = 0; i < cacheSize; i++) {
+      if (cache[i].loading == blocknum) {
+        // someone else is bringing it in, wait until they are done
+        while (wait && cache[i].loading == blocknum) {
+          scond_wait(&slotLoaded, &missMutex);
+        }
+        smutex_unlock(&missMutex);
+        return -1;
+      }
+      if (cache[i].blocknum == blocknum) {
+        smutex_unlock(&missMutex);
+        return -1;
+      }
+    }
+    // with POLICY_RANDOM start looking at a random place, otherwise
+    // the oldest block (by use or by filling) nobody is loading into
+    start = cachePolicy == POLICY_RANDOM ? sthread_rng_below(sthread_rng(), cacheSize) : 0;
+    for (i = 0; i < cacheSize; i++) {
+      if (cache[orderArray[(start + i) % cacheSize]].loading == INVALID) {
+        slot = orderArray[(start + i) % cacheSize];
+        break;
+      }
+    }
+    if (slot == -1) { // every cacheBlock is busy with a miss
+      if (!wait) {
+        break;
+      }
+      scond_wait(&slotLoaded, &missMutex);
+    }
+  }
+  if (slot == -1) {
+    smutex_unlock(&missMutex);
+    return -1;
+  }
+  // a loading cacheBlock's mutex is held across disk I/O, but we skip
+  // those, so this only waits for a copy to finish
+  smutex_lock(&cache[slot].mutex);
+  cache[slot].loading = blocknum;
+  smutex_unlock(&missMutex);
+  return slot;
+}
+
+// Done loading into a claimed cacheBlock, which is still locked
+static void loadedblock(int slot) {
+  smutex_lock(&missMutex);
+  cache[slot].loading = INVALID;
+  scond_broadcast(&slotLoaded, &missMutex);
+  smutex_unlock(&missMutex);
+}
+
+// Tells the store about a block a read miss just brought in
+static void readhints(int blocknum) {
+  // we hold the block now, the store need not keep it cached too
+  dblockhint(blocknum, 1, BLOCKSTORE_DONTNEED);
+  if (READAHEAD > 0 &&
+      __atomic_exchange_n(&lastMiss, blocknum, __ATOMIC_RELAXED) == blocknum - 1) {
+    // sequential misses, get the store started on what comes next
+    dblockhint(blocknum + 1, READAHEAD, BLOCKSTORE_WILLNEED);
+  }
+}
+
+// Reads a block, recording how long it took
 void readblock(char *block, int blocknum) {
+  long long start = sthread_now_ns();
+  bool miss = cacheread(block, blocknum);
+
+  hist_record(&threadhists()->access[0][miss], sthread_now_ns() - start);
+}
+
+// Writes a block, recording how long it took
+void writeblock(char *block, int blocknum) {
+  long long start = sthread_now_ns();
+  bool miss = cachewrite(block, blocknum);
+
+  hist_record(&threadhists()->access[1][miss], sthread_now_ns() - start);
+}
+
+// Reads a block, returns whether it missed
+bool cacheread(char *block, int blocknum) {
   // block provided by tester
   // blocknum is the number of the block to read
 
-  int i;
   int cacheFound = -1; // where is the block with correct blocknum in cache
   int indexToReplace = 0; // which index do we replace?  
+  bool miss = false; // whether we brought the block into the cache
+
+  if (CACHEBYPASS) { // let the store do all the caching
+    dblockread(block, blocknum);
+    return true;
+  }
 
   // redundant, rebroadcast (to make sure the threads start)
   smutex_lock(&orderCountMutex);
@@ -220,38 +1712,51 @@ void readblock(char *block, int blocknum) {
   orderCount += 1;
   smutex_unlock(&orderCountMutex);
 
-  for (i = 0; i < CACHESIZE; i++) {
-    if (cache[i].blocknum == blocknum) {
-      cacheFound = i; // record where we found the correct block
-      break;
-    }
-  }
+  for (;;) {
+    cacheFound = findblock(blocknum);
+    if (cacheFound == -1) { // if we did not find the block in cache
+      indexToReplace = claimblock(blocknum, true); // locks the cacheBlock to replace
+      if (indexToReplace == -1) {
+        continue; // someone else just brought it in, look again
+      }
 
-  if (cacheFound == -1) { // if we did not find the block in cache
-    indexToReplace = orderArray[0]; // replacing cacheBlock[head of orderArray]
-    smutex_lock(&cache[indexToReplace].mutex); // locks the current cacheBlock
-    
-    if (cache[indexToReplace].dirty) {
-      // we have to write to disk the contents of previously cached block
-      dblockwrite(cache[indexToReplace].block, cache[indexToReplace].blocknum);
-    }
-    
-    cache[indexToReplace].blocknum = blocknum; // rewrite blocknum
-    cache[indexToReplace].dirty = false; // cacheBlock is clean now
-    dblockread(cache[indexToReplace].block, blocknum); // read from disk
-    
-    memcpy(block, cache[indexToReplace].block, BLOCKSIZE); // copy to tester
+      miss = true;
+      scounter_add(&statMisses, 1);
+      if (cache[indexToReplace].blocknum != INVALID) {
+        scounter_add(&statEvictions, 1);
+      }
+      if (cache[indexToReplace].dirty) {
+        // we have to write to disk the contents of previously cached block
+        dblockwrite(cache[indexToReplace].block, cache[indexToReplace].blocknum);
+        scounter_add(&statWritebacks, 1);
+      }
 
-    smutex_unlock(&cache[indexToReplace].mutex); // unlocks current cacheBlock
-  }
+      cache[indexToReplace].blocknum = blocknum; // rewrite blocknum
+      cache[indexToReplace].dirty = false; // cacheBlock is clean now
+      missread(cache[indexToReplace].block, blocknum); // read from disk
+      readhints(blocknum);
+      loadedblock(indexToReplace);
+
+      memcpy(block, cache[indexToReplace].block, blockSize); // copy to tester
 
-  else { // we found block in cache
+      smutex_unlock(&cache[indexToReplace].mutex); // unlocks current cacheBlock
+      break;
+    }
+
+    // we found block in cache
     indexToReplace = cacheFound;
     smutex_lock(&cache[indexToReplace].mutex); // locks the cacheBlock
-    
-    memcpy(block, cache[indexToReplace].block, BLOCKSIZE); // copy to tester
+    if (cache[indexToReplace].blocknum != blocknum) {
+      // evicted while we waited for the lock, look again
+      smutex_unlock(&cache[indexToReplace].mutex);
+      continue;
+    }
+    scounter_add(&statHits, 1);
+
+    memcpy(block, cache[indexToReplace].block, blockSize); // copy to tester
 
     smutex_unlock(&cache[indexToReplace].mutex); // unlocks the cacheBlock
+    break;
   }
 
   smutex_lock(&orderCountMutex);
@@ -264,6 +1769,10 @@ void readblock(char *block, int blocknum) {
   }
   smutex_unlock(&orderCountMutex);
 
+  if (cachePolicy == POLICY_RANDOM || (cachePolicy == POLICY_FIFO && !miss)) {
+    return miss; // the order only changes on a use (LRU) or a fill (FIFO)
+  }
+
   smutex_lock(&orderCountMutex);
   while (orderCount != 0) {
     scond_wait(&orderCountZero, &orderCountMutex);
@@ -271,6 +1780,7 @@ void readblock(char *block, int blocknum) {
   orderCount -= 1;
   smutex_unlock(&orderCountMutex);
 
+  putTouchedToEnd(); // earlier uses first
   putToEnd(indexToReplace); // updates the orderArray
 
   smutex_lock(&orderCountMutex);
@@ -278,15 +1788,22 @@ void readblock(char *block, int blocknum) {
   scond_broadcast(&orderCountZero, &orderCountMutex);
   scond_broadcast(&orderCountNonnegative, &orderCountMutex);
   smutex_unlock(&orderCountMutex);
+  return miss;
 }
 
-void writeblock(char *block, int blocknum) {
+// Writes a block, returns whether it missed
+bool cachewrite(char *block, int blocknum) {
   // block provided by tester
   // blocknum is the number of the block to read
 
-  int i;
   int cacheFound = -1; // where is the block with correct blocknum in cache
   int indexToReplace = 0; // which index do we replace?  
+  bool miss = false; // whether we brought the block into the cache
+
+  if (CACHEBYPASS) { // let the store do all the caching
+    dblockwrite(block, blocknum);
+    return true;
+  }
 
   // redundant, rebroadcast (to make sure the threads start)
   smutex_lock(&orderCountMutex);
@@ -306,38 +1823,51 @@ void writeblock(char *block, int blocknum) {
   orderCount += 1;
   smutex_unlock(&orderCountMutex);
 
-  for (i = 0; i < CACHESIZE; i++) {
-    if (cache[i].blocknum == blocknum) {
-      cacheFound = i; // record where we found the correct block
-      break;
-    }
-  }
+  for (;;) {
+    cacheFound = findblock(blocknum);
+    if (cacheFound == -1) { // if we did not find the block in cache
+      indexToReplace = claimblock(blocknum, true); // locks the cacheBlock to replace
+      if (indexToReplace == -1) {
+        continue; // someone else just brought it in, look again
+      }
 
-  if (cacheFound == -1) { // if we did not find the block in cache
-    indexToReplace = orderArray[0]; // replacing cacheBlock[head of orderArray]
-    smutex_lock(&cache[indexToReplace].mutex); // locks the current cacheBlock
-    
-    if (cache[indexToReplace].dirty) {
-      // we have to write to disk the contents of previously cached block
-      dblockwrite(cache[indexToReplace].block, cache[indexToReplace].blocknum);
+      miss = true;
+      scounter_add(&statMisses, 1);
+      if (cache[indexToReplace].blocknum != INVALID) {
+        scounter_add(&statEvictions, 1);
+      }
+      if (cache[indexToReplace].dirty) {
+        // we have to write to disk the contents of previously cached block
+        dblockwrite(cache[indexToReplace].block, cache[indexToReplace].blocknum);
+        scounter_add(&statWritebacks, 1);
+      }
+
+      cache[indexToReplace].blocknum = blocknum; // rewrite blocknum
+      cache[indexToReplace].dirty = true; // make cacheBlock dirty
+      memcpy(cache[indexToReplace].block, block, blockSize); // copy from tester
+      // the store's copy is stale until we evict this, don't keep it cached
+      dblockhint(blocknum, 1, BLOCKSTORE_DONTNEED);
+      loadedblock(indexToReplace);
+
+      smutex_unlock(&cache[indexToReplace].mutex); // unlock current cacheBlock
+      break;
     }
-    
-    cache[indexToReplace].blocknum = blocknum; // rewrite blocknum
-    cache[indexToReplace].dirty = true; // make cacheBlock dirty
-    memcpy(cache[indexToReplace].block, block, BLOCKSIZE); // copy from tester
-    
-    smutex_unlock(&cache[indexToReplace].mutex); // unlock current cacheBlock
-  }
 
-  else { // we found block in cache
+    // we found block in cache
     indexToReplace = cacheFound;
     smutex_lock(&cache[indexToReplace].mutex); // locks the cacheBlock
-    
-    cache[indexToReplace].blocknum = blocknum; // replace cacheBlock's blocknum
+    if (cache[indexToReplace].blocknum != blocknum) {
+      // evicted while we waited for the lock, look again
+      smutex_unlock(&cache[indexToReplace].mutex);
+      continue;
+    }
+    scounter_add(&statHits, 1);
+
     cache[indexToReplace].dirty = true; // make cacheBlock dirty
-    memcpy(cache[indexToReplace].block, block, BLOCKSIZE); // copy from tester
+    memcpy(cache[indexToReplace].block, block, blockSize); // copy from tester
 
     smutex_unlock(&cache[indexToReplace].mutex); // unlock the cacheBlock
+    break;
   }
 
   smutex_lock(&orderCountMutex);
@@ -350,6 +1880,10 @@ void writeblock(char *block, int blocknum) {
   }
   smutex_unlock(&orderCountMutex);
 
+  if (cachePolicy == POLICY_RANDOM || (cachePolicy == POLICY_FIFO && !miss)) {
+    return miss; // the order only changes on a use (LRU) or a fill (FIFO)
+  }
+
   smutex_lock(&orderCountMutex);
   while (orderCount != 0) {
     scond_wait(&orderCountZero, &orderCountMutex);
@@ -357,6 +1891,7 @@ void writeblock(char *block, int blocknum) {
   orderCount -= 1;
   smutex_unlock(&orderCountMutex);
 
+  putTouchedToEnd(); // earlier uses first
   putToEnd(indexToReplace); // updates the orderArray
 
   smutex_lock(&orderCountMutex);
@@ -364,4 +1899,289 @@ void writeblock(char *block, int blocknum) {
   scond_broadcast(&orderCountZero, &orderCountMutex);
   scond_broadcast(&orderCountNonnegative, &orderCountMutex);
   smutex_unlock(&orderCountMutex);
-}
\ No newline at end of file
+  return miss;
+}
+
+// Enters the cache for cachetryhit or cachestartmiss; only waits
+// for a reorder, which never does I/O
+static void enterorder() {
+  smutex_lock(&orderCountMutex);
+  while (orderCount < 0) {
+    scond_wait(&orderCountNonnegative, &orderCountMutex);
+  }
+  orderCount += 1;
+  smutex_unlock(&orderCountMutex);
+}
+
+// Leaves the cache again, moving slot (unless -1) to the end of
+// orderArray: at once if nobody else is in, otherwise by recording
+// it in touched, rather than waiting for them all to leave
+static void leaveorder(int slot) {
+  smutex_lock(&orderCountMutex);
+  orderCount -= 1;
+  if (slot != -1) {
+    if (orderCount == 0) { // nobody else in, reorder now
+      orderCount = -1;
+      smutex_unlock(&orderCountMutex);
+      putTouchedToEnd();
+      putToEnd(slot);
+      smutex_lock(&orderCountMutex);
+      orderCount = 0;
+    }
+    else {
+      touched[slot] = true;
+    }
+  }
+  if (orderCount == 0) {
+    scond_broadcast(&orderCountZero, &orderCountMutex);
+  }
+  if (orderCount >= 0) {
+    scond_broadcast(&orderCountNonnegative, &orderCountMutex);
+  }
+  smutex_unlock(&orderCountMutex);
+}
+
+// Serves a hit without waiting on disk I/O: reads blocknum into block,
+// or writes block to it, if it is cached and its cacheBlock is not
+// locked by a miss. Returns false, having done nothing, otherwise.
+static bool cachetryhit(char *block, int blocknum, bool write) {
+  long long start = sthread_now_ns();
+  int slot;
+
+  if (CACHEBYPASS) {
+    return false;
+  }
+
+  enterorder();
+  slot = findblock(blocknum);
+  if (slot != -1 && !smutex_trylock(&cache[slot].mutex)) {
+    slot = -1; // a miss holds it across disk I/O
+  }
+  if (slot != -1 && cache[slot].blocknum != blocknum) {
+    smutex_unlock(&cache[slot].mutex); // evicted since findblock
+    slot = -1;
+  }
+  if (slot != -1) {
+    scounter_add(&statHits, 1);
+    if (write) {
+      cache[slot].dirty = true;
+      memcpy(cache[slot].block, block, blockSize);
+    }
+    else {
+      memcpy(block, cache[slot].block, blockSize);
+    }
+    smutex_unlock(&cache[slot].mutex);
+  }
+  leaveorder(cachePolicy == POLICY_LRU ? slot : -1);
+
+  if (slot != -1) {
+    hist_record(&threadhists()->access[write][0], sthread_now_ns() - start);
+  }
+  return slot != -1;
+}
+
+/* Asynchronous cache routines
+ *
+ * Hits are served on the caller's thread by cachetryhit. On a store
+ * that completes I/O by itself (see blockstore_async), cachestartmiss
+ * starts a miss's disk I/O from the caller's thread too and the store
+ * finishes it, so one tester keeps all its misses in flight without
+ * a thread for each. A miss that would have to wait for another
+ * miss's disk I/O first, and every miss on the other stores (or with
+ * coalescing or the bypass on), still goes to a pool of cache I/O
+ * threads that run the blocking readblock/writeblock.
+ */
+
+// whether cachestartmiss can be used, set by cacheasyncinit
+static bool asyncMisses;
+
+// the cache I/O threads, a single pipeline stage that runs the blocking
+// readblock/writeblock for each miss and posts it back to its client
+static spipeline_t asyncPipeline;
+
+static void *asyncServe(void *item, void *unused) {
+  struct cacheRequest *req = item;
+
+  if (req->write) {
+    writeblock(req->block, req->blocknum);
+  }
+  else {
+    readblock(req->block, req->blocknum);
+  }
+  squeue_push(&req->client->completions, req);
+  return NULL; // handed off to the client
+}
+
+// An asynchronous writeback is on disk, reads of its block may go ahead
+static void writtenback(void *arg) {
+  struct writeBack *wb = arg, **p;
+
+  smutex_lock(&missMutex);
+  for (p = &writeBacks; *p != wb; p = &(*p)->next) {
+  }
+  *p = wb->next;
+  scond_broadcast(&slotLoaded, &missMutex);
+  smutex_unlock(&missMutex);
+  free(wb);
+}
+
+// An asynchronous read miss has its block, finish it on the store's
+// thread. The cacheBlock was locked on the tester's thread; unlocking
+// it here relies on glibc's default mutexes not checking the owner,
+// as green threads that move between carriers do.
+static void missdone(void *arg) {
+  struct cacheRequest *req = arg;
+  int slot = req->slot;
+
+  readhints(req->blocknum);
+  loadedblock(slot);
+  memcpy(req->block, cache[slot].block, blockSize); // copy to tester
+  smutex_unlock(&cache[slot].mutex);
+  hist_record(&threadhists()->access[0][1], sthread_now_ns() - req->start);
+  // never blocks, the queue has room for every outstanding request
+  squeue_push(&req->client->completions, req);
+}
+
+// Starts the miss req without waiting on disk I/O: claims a cacheBlock,
+// starts writing back its dirty contents, and for a read starts reading
+// the block into it and leaves the rest to missdone; a write miss is
+// done right away. Returns false, having done nothing, if the block
+// turned out to be cached or it would have to wait for another miss.
+static bool cachestartmiss(struct cacheRequest *req) {
+  int slot = -1;
+  struct writeBack *wb;
+
+  req->start = sthread_now_ns();
+  enterorder();
+  if (findblock(req->blocknum) == -1) {
+    slot = claimblock(req->blocknum, false); // locks the cacheBlock
+  }
+  if (slot == -1) {
+    leaveorder(-1);
+    return false;
+  }
+
+  scounter_add(&statMisses, 1);
+  if (cache[slot].blocknum != INVALID) {
+    scounter_add(&statEvictions, 1);
+  }
+  if (cache[slot].dirty) { // the store copies it before returning
+    wb = malloc(sizeof(*wb));
+    wb->blocknum = cache[slot].blocknum;
+    smutex_lock(&missMutex);
+    wb->next = writeBacks;
+    writeBacks = wb;
+    smutex_unlock(&missMutex);
+    blockstore_write_async(disk, cache[slot].block, wb->blocknum,
+                           writtenback, wb);
+    scounter_add(&statWritebacks, 1);
+  }
+  cache[slot].blocknum = req->blocknum;
+  cache[slot].dirty = req->write;
+  req->slot = slot;
+  leaveorder(cachePolicy != POLICY_RANDOM ? slot : -1); // a fill
+
+  if (req->write) {
+    memcpy(cache[slot].block, req->block, blockSize); // copy from tester
+    // the store's copy is stale until we evict this, don't keep it cached
+    dblockhint(req->blocknum, 1, BLOCKSTORE_DONTNEED);
+    loadedblock(slot);
+    smutex_unlock(&cache[slot].mutex);
+    hist_record(&threadhists()->access[1][1], sthread_now_ns() - req->start);
+    squeue_push(&req->client->completions, req);
+  }
+  else {
+    blockstore_read_async(disk, cache[slot].block, req->blocknum, missdone,
+                          req);
+  }
+  return true;
+}
+
+// Starts nworkers cache I/O threads, which accept up to depth
+// requests before readblock_async/writeblock_async start to block
+void cacheasyncinit(int nworkers, int depth) {
+  asyncMisses = blockstore_async(disk) && COALESCE_WINDOW <= 0 &&
+                !CACHEBYPASS;
+  spipeline_init(&asyncPipeline);
+  spipeline_add_stage(&asyncPipeline, asyncServe, NULL, nworkers, depth);
+  spipeline_start(&asyncPipeline);
+}
+
+// Waits for all submitted requests to be served and the writebacks
+// they started to reach the disk, stops the I/O threads
+void cacheasyncfinish() {
+  spipeline_finish(&asyncPipeline);
+  spipeline_destroy(&asyncPipeline);
+  smutex_lock(&missMutex);
+  while (writeBacks != NULL) {
+    scond_wait(&slotLoaded, &missMutex);
+  }
+  smutex_unlock(&missMutex);
+}
+
+// Sets up a client that will have at most depth requests outstanding
+void cacheclientinit(struct cacheClient *client, int depth) {
+  squeue_init(&client->completions, depth);
+  client->outstanding = 0;
+}
+
+void cacheclientdestroy(struct cacheClient *client) {
+  squeue_destroy(&client->completions);
+}
+
+// Completes a hit at once, starts a miss, or failing that queues it
+// for the cache I/O threads
+static void submit(struct cacheClient *client, char *block, int blocknum,
+                   bool write, long tag) {
+  struct cacheRequest *req = malloc(sizeof(*req));
+
+  req->client = client;
+  req->block = block;
+  req->blocknum = blocknum;
+  req->write = write;
+  req->tag = tag;
+  client->outstanding++;
+  if (cachetryhit(block, blocknum, write)) {
+    // never blocks, the queue has room for every outstanding request
+    squeue_push(&client->completions, req);
+  }
+  else if (!asyncMisses || !cachestartmiss(req)) {
+    spipeline_submit(&asyncPipeline, req);
+  }
+}
+
+// Starts reading blocknum into block; block must stay untouched until
+// the completion for tag comes back from cachepoll or cachewait
+void readblock_async(struct cacheClient *client, char *block, int blocknum,
+                     long tag) {
+  submit(client, block, blocknum, false, tag);
+}
+
+// Starts writing block to blocknum; block must stay untouched until
+// the completion for tag comes back from cachepoll or cachewait
+void writeblock_async(struct cacheClient *client, char *block, int blocknum,
+                      long tag) {
+  submit(client, block, blocknum, true, tag);
+}
+
+// Copies out a finished request if there is one, returns whether there was
+bool cachepoll(struct cacheClient *client, struct cacheRequest *done) {
+  void *req;
+
+  if (!squeue_trypop(&client->completions, &req)) {
+    return false;
+  }
+  *done = *(struct cacheRequest *)req;
+  free(req);
+  client->outstanding--;
+  return true;
+}
+
+// Waits for the next request to finish and copies it out
+void cachewait(struct cacheClient *client, struct cacheRequest *done) {
+  void *req = squeue_pop(&client->completions);
+
+  *done = *(struct cacheRequest *)req;
+  free(req);
+  client->outstanding--;
+}
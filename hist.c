@@ -0,0 +1,103 @@
+/*
+ * hist.c -- log-linear latency histograms
+ *
+ * See hist.h.
+ */
+
+#include <string.h>
+#include "hist.h"
+
+#define SUB (1LL << HIST_SUB_BITS)
+
+/*
+ * bucket()
+ *
+ * Values below SUB get a bucket each. A larger value whose top bit
+ * is bit e keeps its HIST_SUB_BITS + 1 leading bits: the buckets
+ * for e start at (e - HIST_SUB_BITS + 1) * SUB and the leading bits,
+ * less the top one, pick one of the SUB buckets within.
+ */
+static int bucket(long long value)
+{
+  int e, shift;
+
+  if(value < SUB){
+    return value < 0 ? 0 : (int)value;
+  }
+  e = 63 - __builtin_clzll(value);
+  if(e >= HIST_MAX_BITS){
+    return HIST_BUCKETS - 1;
+  }
+  shift = e - HIST_SUB_BITS;
+  return (shift + 1) * SUB + (int)((value >> shift) - SUB);
+}
+
+// the largest value that lands in bucket i
+static long long highest(int i)
+{
+  int shift;
+
+  if(i < SUB){
+    return i;
+  }
+  shift = i / SUB - 1;
+  return ((SUB + i % SUB + 1) << shift) - 1;
+}
+
+void hist_init(struct hist *h)
+{
+  memset(h, 0, sizeof(*h));
+}
+
+void hist_record(struct hist *h, long long value)
+{
+  h->buckets[bucket(value)]++;
+  h->count++;
+  h->sum += value;
+  if(value > h->max){
+    h->max = value;
+  }
+}
+
+void hist_merge(struct hist *into, const struct hist *h)
+{
+  int i;
+
+  for(i = 0; i < HIST_BUCKETS; i++){
+    into->buckets[i] += h->buckets[i];
+  }
+  into->count += h->count;
+  into->sum += h->sum;
+  if(h->max > into->max){
+    into->max = h->max;
+  }
+}
+
+long long hist_percentile(const struct hist *h, double p)
+{
+  long long rank, seen = 0;
+  int i;
+
+  if(h->count == 0){
+    return 0;
+  }
+  if(p >= 100){
+    return h->max;
+  }
+  rank = (long long)(p / 100 * h->count + 0.5); // recordings at or below
+  if(rank < 1){
+    rank = 1;
+  }
+  for(i = 0; i < HIST_BUCKETS; i++){
+    seen += h->buckets[i];
+    if(seen >= rank){
+      return highest(i) < h->max ? highest(i) : h->max;
+    }
+  }
+  return h->max;
+}
+
+double hist_mean(const struct hist *h)
+{
+  return h->count > 0 ? (double)h->sum / h->count : 0;
+}
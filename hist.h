@@ -0,0 +1,46 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Log-linear latency histograms
+ *
+ * Values (typically ns) are counted in HDR histogram style buckets:
+ * exact below 2^HIST_SUB_BITS, and above that each power of two is
+ * split into 2^HIST_SUB_BITS equal buckets, so every bucket is
+ * within 1/2^HIST_SUB_BITS (about 1.6%) of the values it holds,
+ * from a few ns to 2^HIST_MAX_BITS ns (18 minutes); larger values
+ * count as the largest. Recording is a few instructions and no
+ * allocation, and histograms recorded separately (e.g. one per
+ * thread) can be merged for reporting.
+ *
+ * A histogram is not thread safe: give each recording thread its
+ * own and merge them once they are done.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+  long long count;
+  long long sum;
+  long long max;
+  long buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct hist *h);
+void hist_record(struct hist *h, long long value);
+void hist_merge(struct hist *into, const struct hist *h);
+// the value p percent (0-100) of the recordings are at or below,
+// to within the bucket width; 100 gives the exact maximum
+long long hist_percentile(const struct hist *h, double p);
+double hist_mean(const struct hist *h);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif
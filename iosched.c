@@ -0,0 +1,364 @@
+/*
+ * iosched.c -- I/O scheduler between the cache and its block store
+ *
+ * See iosched.h for the policies and options.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sthread.h"
+#include "iosched.h"
+#include "spec.h"
+
+#define IOSCHED_FIFO 0
+#define IOSCHED_ELEVATOR 1
+#define IOSCHED_DEADLINE 2
+
+#define IOSCHED_MAXMERGE 256
+
+struct ioreq {
+  int write;
+  int blocknum;
+  char *block; // buffer to read into or write from
+  long long submitted; // sthread_now_ns() at submission
+  int dispatched;
+  int done;
+  struct ioreq *next;
+};
+
+struct iosched {
+  struct blockstore base;
+  struct blockstore *disk;
+  int policy;
+  int readfirst;
+  int merge; // most blocks per dispatch
+  int depth; // most dispatches in flight
+  long long expire[2]; // deadline policy, by direction
+  smutex_t mutex; // protects the fields below
+  scond_t done; // some request finished
+  struct ioreq *head, *tail; // outstanding requests, oldest first
+  int queued; // not yet dispatched
+  int inflight; // dispatches in progress
+  int pos; // block after the last one dispatched
+  struct iosched_stats stats;
+};
+
+/*
+ * blocked()
+ *
+ * Whether r has to wait for an older request on the same block.
+ * Reads may pass reads, but nothing passes a write or is passed
+ * by one.
+ */
+static int blocked(struct iosched *s, struct ioreq *r)
+{
+  struct ioreq *e;
+
+  for(e = s->head; e != r; e = e->next){
+    if(e->blocknum == r->blocknum && (e->write || r->write)){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// whether r may be picked now
+static int eligible(struct iosched *s, struct ioreq *r, int readsonly)
+{
+  return !r->dispatched && !(readsonly && r->write) && !blocked(s, r);
+}
+
+/*
+ * pick()
+ *
+ * Choose the next request to dispatch according to the policy, or
+ * NULL if every queued request is blocked behind another.
+ */
+static struct ioreq *pick(struct iosched *s)
+{
+  struct ioreq *r, *best = NULL, *lowest = NULL;
+  int readsonly = 0;
+  long long now;
+
+  if(s->readfirst){
+    for(r = s->head; r != NULL; r = r->next){
+      if(!r->dispatched && !r->write && !blocked(s, r)){
+        readsonly = 1;
+        break;
+      }
+    }
+  }
+
+  if(s->policy == IOSCHED_DEADLINE){
+    // the oldest eligible request goes first if it has expired
+    now = sthread_now_ns();
+    for(r = s->head; r != NULL; r = r->next){
+      if(eligible(s, r, readsonly)){
+        if(now - r->submitted >= s->expire[r->write]){
+          return r;
+        }
+        break;
+      }
+    }
+  }
+
+  for(r = s->head; r != NULL; r = r->next){
+    if(!eligible(s, r, readsonly)){
+      continue;
+    }
+    if(s->policy == IOSCHED_FIFO){
+      return r;
+    }
+    // C-LOOK: nearest block at or after pos, else the lowest one
+    if(r->blocknum >= s->pos &&
+       (best == NULL || r->blocknum < best->blocknum)){
+      best = r;
+    }
+    if(lowest == NULL || r->blocknum < lowest->blocknum){
+      lowest = r;
+    }
+  }
+  return best != NULL ? best : lowest;
+}
+
+/*
+ * gather()
+ *
+ * Grow the dispatch starting with first by queued requests in the
+ * same direction for the blocks just below or above it, up to the
+ * merge limit. Fills batch (in block order) and returns its length.
+ */
+static int gather(struct iosched *s, struct ioreq *first,
+                  struct ioreq **batch)
+{
+  struct ioreq *r;
+  int lo = first->blocknum, hi = first->blocknum, n = 1, grew, i;
+
+  batch[0] = first;
+  first->dispatched = 1;
+  do{
+    grew = 0;
+    for(r = s->head; r != NULL && n < s->merge; r = r->next){
+      if(r->dispatched || r->write != first->write ||
+         (r->blocknum != lo - 1 && r->blocknum != hi + 1) || blocked(s, r)){
+        continue;
+      }
+      if(r->blocknum == lo - 1){
+        memmove(batch + 1, batch, n * sizeof(*batch));
+        batch[0] = r;
+        lo--;
+      }
+      else{
+        batch[n] = r;
+        hi++;
+      }
+      r->dispatched = 1;
+      n++;
+      grew = 1;
+    }
+  } while(grew && n < s->merge);
+
+  for(i = 0; i < n; i++){
+    assert(batch[i]->blocknum == lo + i);
+  }
+  return n;
+}
+
+/*
+ * dispatch()
+ *
+ * Take the next batch off the queue and do it, dropping the lock
+ * around the store request. Returns 0 if nothing could be picked.
+ */
+static int dispatch(struct iosched *s)
+{
+  struct ioreq *batch[IOSCHED_MAXMERGE];
+  char *blocks[IOSCHED_MAXMERGE];
+  struct ioreq *first = pick(s), **pp;
+  long long now, wait;
+  int n, i, dir;
+
+  if(first == NULL){
+    return 0;
+  }
+  n = gather(s, first, batch);
+  dir = first->write;
+  now = sthread_now_ns();
+  for(i = 0; i < n; i++){
+    blocks[i] = batch[i]->block;
+    wait = now - batch[i]->submitted;
+    s->stats.wait_ns[dir] += wait;
+    if(wait > s->stats.max_wait_ns[dir]){
+      s->stats.max_wait_ns[dir] = wait;
+    }
+  }
+  s->stats.dispatches[dir]++;
+  s->queued -= n;
+  s->inflight++;
+  s->pos = batch[n - 1]->blocknum + 1;
+  smutex_unlock(&s->mutex);
+
+  if(dir){
+    blockstore_writev(s->disk, (const char *const *)blocks,
+                      batch[0]->blocknum, n);
+  }
+  else{
+    blockstore_readv(s->disk, blocks, batch[0]->blocknum, n);
+  }
+
+  smutex_lock(&s->mutex);
+  s->inflight--;
+  for(i = 0; i < n; i++){
+    batch[i]->done = 1;
+  }
+  s->tail = NULL;
+  for(pp = &s->head; *pp != NULL; ){
+    if((*pp)->done){
+      *pp = (*pp)->next;
+    }
+    else{
+      s->tail = *pp;
+      pp = &(*pp)->next;
+    }
+  }
+  scond_broadcast(&s->done, &s->mutex);
+  return 1;
+}
+
+/*
+ * submit()
+ *
+ * Queue a request and return once it is done, dispatching requests
+ * (ours or anyone's) whenever a dispatch slot is free.
+ */
+static void submit(struct iosched *s, int write, char *block, int blocknum)
+{
+  struct ioreq r;
+
+  r.write = write;
+  r.blocknum = blocknum;
+  r.block = block;
+  r.dispatched = 0;
+  r.done = 0;
+  r.next = NULL;
+
+  smutex_lock(&s->mutex);
+  r.submitted = sthread_now_ns();
+  if(s->tail){
+    s->tail->next = &r;
+  }
+  else{
+    s->head = &r;
+  }
+  s->tail = &r;
+  s->queued++;
+  s->stats.requests[write]++;
+  s->stats.depth_sum += s->queued;
+  if(s->queued > s->stats.max_depth){
+    s->stats.max_depth = s->queued;
+  }
+
+  while(!r.done){
+    if(s->inflight < s->depth && s->queued > 0 && dispatch(s)){
+      continue;
+    }
+    scond_wait(&s->done, &s->mutex);
+  }
+  smutex_unlock(&s->mutex);
+}
+
+static void iosched_read(struct blockstore *bs, char *block, int blocknum)
+{
+  submit((struct iosched *)bs, 0, block, blocknum);
+}
+
+static void iosched_write(struct blockstore *bs, const char *block,
+                          int blocknum)
+{
+  submit((struct iosched *)bs, 1, (char *)block, blocknum);
+}
+
+static void iosched_load(struct blockstore *bs, const char *block,
+                         int blocknum)
+{
+  blockstore_load(((struct iosched *)bs)->disk, block, blocknum);
+}
+
+static void iosched_hint(struct blockstore *bs, int blocknum, int count,
+                         int hint)
+{
+  blockstore_hint(((struct iosched *)bs)->disk, blocknum, count, hint);
+}
+
+static void iosched_close(struct blockstore *bs)
+{
+  struct iosched *s = (struct iosched *)bs;
+
+  assert(s->head == NULL);
+  blockstore_close(s->disk);
+  scond_destroy(&s->done);
+  smutex_destroy(&s->mutex);
+  free(s);
+}
+
+static const struct blockstore_ops iosched_ops = {
+  iosched_read, iosched_write, iosched_load, iosched_close, iosched_hint,
+  NULL, NULL
+};
+
+struct blockstore *iosched_open(struct blockstore *disk, const char *spec)
+{
+  struct iosched *s = (struct iosched *)calloc(1, sizeof(*s));
+  const char *opts = strchr(spec, ',');
+  char val[32];
+  size_t n = opts ? (size_t)(opts - spec) : strlen(spec);
+
+  if(s == NULL){
+    perror("iosched allocation failed");
+    exit(-1);
+  }
+  if(n == 4 && strncmp(spec, "fifo", n) == 0){
+    s->policy = IOSCHED_FIFO;
+  }
+  else if(n == 8 && strncmp(spec, "elevator", n) == 0){
+    s->policy = IOSCHED_ELEVATOR;
+  }
+  else if(n == 8 && strncmp(spec, "deadline", n) == 0){
+    s->policy = IOSCHED_DEADLINE;
+  }
+  else{
+    fprintf(stderr, "iosched: unknown policy \"%.*s\"\n", (int)n, spec);
+    exit(-1);
+  }
+  opts = opts ? opts + 1 : "";
+  s->readfirst = spec_option(opts, "readfirst", val, sizeof(val));
+  s->merge = spec_number(opts, "merge", 16);
+  s->depth = spec_number(opts, "depth", 1);
+  s->expire[0] = spec_number(opts, "read_expire", 50000000);
+  s->expire[1] = spec_number(opts, "write_expire", 500000000);
+  if(s->merge < 1 || s->merge > IOSCHED_MAXMERGE || s->depth < 1){
+    fprintf(stderr, "iosched: merge must be 1-%d and depth positive\n",
+            IOSCHED_MAXMERGE);
+    exit(-1);
+  }
+
+  s->base.ops = &iosched_ops;
+  s->base.nblocks = disk->nblocks;
+  s->base.blocksize = disk->blocksize;
+  s->disk = disk;
+  smutex_init_named(&s->mutex, "iosched");
+  scond_init_named(&s->done, "iosched done");
+  return &s->base;
+}
+
+void iosched_stats(struct blockstore *sched, struct iosched_stats *stats)
+{
+  struct iosched *s = (struct iosched *)sched;
+
+  assert(sched->ops == &iosched_ops);
+  smutex_lock(&s->mutex);
+  *stats = s->stats;
+  smutex_unlock(&s->mutex);
+}
@@ -0,0 +1,57 @@
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+#include "blockstore.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * I/O scheduler
+ *
+ * Sits between the cache and its block store. Requests are queued
+ * and dispatched to the store at most depth at a time, in an order
+ * chosen by the policy, and queued requests for consecutive blocks
+ * in the same direction are merged into a single store request.
+ * The scheduler is itself a block store, so it is used through the
+ * usual blockstore_read()/blockstore_write() calls, and closing it
+ * closes the store underneath.
+ *
+ * There are no dispatcher threads: whichever caller finds a free
+ * dispatch slot does the next request (which may be another
+ * caller's) on its behalf, so it works the same for green threads
+ * and in virtual time.
+ *
+ * The spec is POLICY[,readfirst][,merge=N][,depth=N]
+ * [,read_expire=NS][,write_expire=NS], where POLICY is one of
+ *
+ *   fifo      in order of submission
+ *   elevator  in ascending block order from the last request,
+ *             wrapping around at the end (C-LOOK)
+ *   deadline  like elevator, but a request that has waited longer
+ *             than read_expire or write_expire (default 50ms and
+ *             500ms) goes first
+ *
+ * With readfirst, writes are only dispatched when no read is
+ * waiting. merge caps the blocks per dispatch (default 16, 1 turns
+ * merging off) and depth defaults to 1. Requests for the same block
+ * are never reordered if either is a write.
+ */
+struct iosched_stats {
+  long requests[2]; // [0] reads, [1] writes
+  long dispatches[2]; // store requests made, after merging
+  long long wait_ns[2]; // total time from submission to dispatch
+  long long max_wait_ns[2];
+  long long depth_sum; // queue depth each submission found, summed
+  int max_depth;
+};
+
+struct blockstore *iosched_open(struct blockstore *disk, const char *spec);
+void iosched_stats(struct blockstore *sched, struct iosched_stats *stats);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif
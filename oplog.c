@@ -0,0 +1,153 @@
+/*
+ * oplog.c -- binary operation log with a background drainer
+ *
+ * See oplog.h.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "oplog.h"
+
+#define OPLOG_IDLE_NS 1000000 // drainer's nap when every ring is empty
+
+struct oplog_ring {
+  struct oplog_record *records;
+  unsigned long mask;
+  unsigned long head __attribute__((aligned(STHREAD_CACHELINE)));
+  unsigned long tail_cache; // producer's last look at tail
+  unsigned long tail __attribute__((aligned(STHREAD_CACHELINE)));
+};
+
+struct oplog {
+  int nrings;
+  struct oplog_ring *rings;
+  void (*sink)(const struct oplog_record *, void *);
+  void *arg;
+  int stopping; // atomic
+  sthread_t drainer;
+};
+
+/*
+ * drain()
+ *
+ * Pass everything now in the rings to the sink. Returns how many
+ * records there were.
+ */
+static long drain(struct oplog *log)
+{
+  struct oplog_ring *q;
+  unsigned long tail, head;
+  long n = 0;
+  int i;
+
+  for(i = 0; i < log->nrings; i++){
+    q = &log->rings[i];
+    tail = q->tail;
+    head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    for(; tail != head; tail++){
+      log->sink(&q->records[tail & q->mask], log->arg);
+      n++;
+    }
+    __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+static void *drainer(void *arg)
+{
+  struct oplog *log = (struct oplog *)arg;
+
+  while(!__atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE)){
+    if(drain(log) == 0){
+      sthread_sleep(0, OPLOG_IDLE_NS);
+    }
+  }
+  drain(log); // whatever came in before the stop
+  return NULL;
+}
+
+struct oplog *oplog_open(int nrings, unsigned long capacity,
+                         void (*sink)(const struct oplog_record *, void *),
+                         void *arg)
+{
+  struct oplog *log = (struct oplog *)calloc(1, sizeof(*log));
+  unsigned long size = 1;
+  int i;
+
+  assert(nrings > 0 && capacity > 0);
+  while(size < capacity){
+    size <<= 1;
+  }
+  if(log == NULL ||
+     posix_memalign((void **)&log->rings, STHREAD_CACHELINE,
+                    nrings * sizeof(struct oplog_ring)) != 0){
+    perror("oplog allocation failed");
+    exit(-1);
+  }
+  for(i = 0; i < nrings; i++){
+    log->rings[i].records = (struct oplog_record *)malloc(
+      size * sizeof(struct oplog_record));
+    if(log->rings[i].records == NULL){
+      perror("oplog allocation failed");
+      exit(-1);
+    }
+    log->rings[i].mask = size - 1;
+    log->rings[i].head = 0;
+    log->rings[i].tail_cache = 0;
+    log->rings[i].tail = 0;
+  }
+  log->nrings = nrings;
+  log->sink = sink;
+  log->arg = arg;
+  sthread_create_p(&log->drainer, drainer, log);
+  return log;
+}
+
+void oplog_write(struct oplog *log, int ring, const struct oplog_record *r)
+{
+  struct oplog_ring *q = &log->rings[ring];
+  unsigned long head = q->head;
+
+  assert(ring >= 0 && ring < log->nrings);
+  while(head - q->tail_cache > q->mask){
+    q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if(head - q->tail_cache > q->mask){
+      sthread_yield(); // full, let the drainer catch up
+    }
+  }
+  q->records[head & q->mask] = *r;
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * oplog_flush()
+ *
+ * Wait for the drainer to get through what every ring holds now.
+ */
+void oplog_flush(struct oplog *log)
+{
+  struct oplog_ring *q;
+  int i;
+
+  for(i = 0; i < log->nrings; i++){
+    q = &log->rings[i];
+    while(__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) !=
+          __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)){
+      sthread_sleep(0, OPLOG_IDLE_NS / 10);
+    }
+  }
+}
+
+void oplog_close(struct oplog *log)
+{
+  int i;
+
+  __atomic_store_n(&log->stopping, 1, __ATOMIC_RELEASE);
+  sthread_join_p(log->drainer);
+  for(i = 0; i < log->nrings; i++){
+    free(log->rings[i].records);
+  }
+  free(log->rings);
+  free(log);
+}
@@ -0,0 +1,51 @@
+#ifndef _OPLOG_H_
+#define _OPLOG_H_
+
+#include "sthread.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Binary operation log
+ *
+ * Each producer (e.g. each cachetest tester) appends fixed-size
+ * records to its own ring, which takes no locks and no system calls:
+ * a store of the record and a release store of the ring's head. A
+ * background drainer thread picks the records up and hands them to
+ * the sink, so whatever the sink does (formatting, stdio, disk
+ * writes) happens off the producers' hot path. If a ring fills up
+ * its producer yields until the drainer makes room, so no record is
+ * ever lost.
+ *
+ * Ring n must only be written by one thread at a time. Records from
+ * one ring reach the sink in order; records from different rings
+ * are interleaved as the drainer finds them, so use the timestamps
+ * to order them. oplog_flush() waits until every record written so
+ * far has been through the sink, and oplog_close() flushes, stops
+ * the drainer and frees the log.
+ */
+struct oplog_record {
+  long long when; // sthread_now_ns() when it was logged
+  int thread;
+  int blocknum;
+  int value; // first int of the block read or written
+  int write; // 1 for a write, 0 for a read
+};
+
+struct oplog;
+
+// sink is called by the drainer only, never concurrently
+struct oplog *oplog_open(int nrings, unsigned long capacity,
+                         void (*sink)(const struct oplog_record *, void *),
+                         void *arg);
+void oplog_write(struct oplog *log, int ring, const struct oplog_record *r);
+void oplog_flush(struct oplog *log);
+void oplog_close(struct oplog *log);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif
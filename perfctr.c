@@ -0,0 +1,159 @@
+/*
+ * perfctr.c -- per-thread hardware event counters
+ *
+ * See perfctr.h.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perfctr.h"
+
+static const struct {
+  const char *name;
+  unsigned int type;
+  unsigned long long config;
+} events[PERFCTR_NEVENTS] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+/*
+ * open_event()
+ *
+ * Open event i on thread tid (0 for the calling thread), falling
+ * back to user mode only when perf_event_paranoid forbids counting
+ * the kernel.
+ */
+static int open_event(int i, int tid, int inherit)
+{
+  struct perf_event_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = events[i].type;
+  attr.config = events[i].config;
+  attr.inherit = inherit;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1,
+               PERF_FLAG_FD_CLOEXEC);
+  if(fd < 0 && (errno == EACCES || errno == EPERM)){
+    attr.exclude_kernel = 1;
+    fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+  }
+  return fd;
+}
+
+static int open_events(struct perfctr *pc, int tid, int inherit)
+{
+  int i, n = 0;
+
+  for(i = 0; i < PERFCTR_NEVENTS; i++){
+    pc->fd[i] = open_event(i, tid, inherit);
+    if(pc->fd[i] >= 0){
+      n++;
+    }
+  }
+  return n;
+}
+
+int perfctr_open(struct perfctr *pc, int inherit)
+{
+  return open_events(pc, 0, inherit);
+}
+
+/*
+ * perfctr_open_others()
+ *
+ * List /proc/self/task and open counters on every thread there but
+ * the caller. A thread that exits before its counters are open is
+ * left out.
+ */
+struct perfctr *perfctr_open_others(int *n)
+{
+  DIR *dir = opendir("/proc/self/task");
+  struct dirent *d;
+  struct perfctr *pcs = NULL;
+  int max = 0, self = syscall(SYS_gettid), tid;
+
+  *n = 0;
+  if(dir == NULL){
+    return NULL;
+  }
+  while((d = readdir(dir)) != NULL){
+    tid = atoi(d->d_name);
+    if(tid <= 0 || tid == self){
+      continue;
+    }
+    if(*n == max){
+      max = max > 0 ? 2 * max : 16;
+      pcs = realloc(pcs, max * sizeof(*pcs));
+      if(pcs == NULL){
+        perror("perfctr_open_others");
+        exit(-1);
+      }
+    }
+    if(open_events(&pcs[*n], tid, 0) > 0){
+      (*n)++;
+    }
+  }
+  closedir(dir);
+  return pcs;
+}
+
+/*
+ * perfctr_read()
+ *
+ * A counter that was only on the hardware for part of the time it
+ * was enabled counts value * enabled / running.
+ */
+void perfctr_read(const struct perfctr *pc, long long counts[PERFCTR_NEVENTS])
+{
+  unsigned long long v[3]; // value, time enabled, time running
+  int i;
+
+  for(i = 0; i < PERFCTR_NEVENTS; i++){
+    counts[i] = -1;
+    if(pc->fd[i] < 0 || read(pc->fd[i], v, sizeof(v)) != sizeof(v)){
+      continue;
+    }
+    if(v[2] == 0){
+      counts[i] = 0;
+    }
+    else if(v[2] < v[1]){
+      counts[i] = (long long)((double)v[0] * v[1] / v[2]);
+    }
+    else{
+      counts[i] = v[0];
+    }
+  }
+}
+
+void perfctr_close(struct perfctr *pc)
+{
+  int i;
+
+  for(i = 0; i < PERFCTR_NEVENTS; i++){
+    if(pc->fd[i] >= 0){
+      close(pc->fd[i]);
+      pc->fd[i] = -1;
+    }
+  }
+}
+
+const char *perfctr_name(int event)
+{
+  return events[event].name;
+}
@@ -0,0 +1,50 @@
+#ifndef _PERFCTR_H_
+#define _PERFCTR_H_
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Per-thread hardware event counters
+ *
+ * perfctr_open() starts counting cycles, instructions, last level
+ * cache misses, branch misses and context switches for the calling
+ * thread with perf_event_open(2), in user and, where the system
+ * allows it, kernel mode. With inherit, threads the caller creates
+ * from then on are counted too, once they have exited.
+ *
+ * Each event is opened on its own, so a machine (or VM) without
+ * some of them still counts the rest; perfctr_open() returns how
+ * many it got. perfctr_read() gives the counts so far, scaled up
+ * if the kernel had to time-share the hardware counters, and -1
+ * for events that could not be opened. Counters may be read and
+ * closed from any thread.
+ *
+ * perfctr_open_others() counts the threads the process already has,
+ * other than the caller, such as worker pools started earlier. It
+ * returns a malloc'd array of *n perfctrs, one per thread where
+ * any event could be opened; close each and free the array.
+ */
+#define PERFCTR_CYCLES 0
+#define PERFCTR_INSTRUCTIONS 1
+#define PERFCTR_LLC_MISSES 2
+#define PERFCTR_BRANCH_MISSES 3
+#define PERFCTR_CONTEXT_SWITCHES 4
+#define PERFCTR_NEVENTS 5
+
+struct perfctr {
+  int fd[PERFCTR_NEVENTS]; // -1 if not available
+};
+
+int perfctr_open(struct perfctr *pc, int inherit);
+struct perfctr *perfctr_open_others(int *n);
+void perfctr_read(const struct perfctr *pc, long long counts[PERFCTR_NEVENTS]);
+void perfctr_close(struct perfctr *pc);
+const char *perfctr_name(int event);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * spec.c -- option lists in spec strings
+ *
+ * See spec.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spec.h"
+
+/*
+ * spec_option()
+ *
+ * Look for name (either "name" or "name=value") in the comma
+ * separated option list opts. Returns 1 if it is there and copies
+ * its value (empty if none) into val.
+ */
+int spec_option(const char *opts, const char *name, char *val, size_t len)
+{
+  size_t n = strlen(name);
+  const char *p = opts, *end;
+
+  while(p != NULL && *p != '\0'){
+    end = strchr(p, ',');
+    if(end == NULL){
+      end = p + strlen(p);
+    }
+    if((size_t)(end - p) >= n && strncmp(p, name, n) == 0 &&
+       (p[n] == '=' || p + n == end)){
+      val[0] = '\0';
+      if(p[n] == '='){
+        size_t vlen = end - (p + n + 1);
+        if(vlen >= len){
+          vlen = len - 1;
+        }
+        memcpy(val, p + n + 1, vlen);
+        val[vlen] = '\0';
+      }
+      return 1;
+    }
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return 0;
+}
+
+/*
+ * spec_number()
+ *
+ * Like spec_option(), for an option with a non-negative integer
+ * value. Returns dflt if the option is not there.
+ */
+long long spec_number(const char *opts, const char *name, long long dflt)
+{
+  char val[32], *end;
+  long long n;
+
+  if(!spec_option(opts, name, val, sizeof(val))){
+    return dflt;
+  }
+  n = strtoll(val, &end, 10);
+  if(val[0] == '\0' || *end != '\0' || n < 0){
+    fprintf(stderr, "spec: bad value for %s \"%s\"\n", name, val);
+    exit(-1);
+  }
+  return n;
+}
@@ -0,0 +1,28 @@
+#ifndef _SPEC_H_
+#define _SPEC_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Option lists in spec strings
+ *
+ * The store, scheduler and workload specs (see blockstore.h,
+ * iosched.h, workload.h) end in a comma separated list of options,
+ * each "name" or "name=value". spec_option() looks for name in
+ * opts and, if it is there, returns 1 and copies its value (empty
+ * if none) into val, cut to len - 1 characters. spec_number()
+ * returns the non-negative integer value of name, or dflt if it is
+ * not there; any other value is an error that ends the program.
+ */
+int spec_option(const char *opts, const char *name, char *val, size_t len);
+long long spec_number(const char *opts, const char *name, long long dflt);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif
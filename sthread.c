@@ -8,9 +8,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <ucontext.h>
+#include <sys/mman.h>
 #include "sthread.h"
 
+/*
+ * Hooks into the green thread scheduler (see the end of the file).
+ * Every blocking call checks whether it is running on a green
+ * thread and, if so, parks that thread instead of the OS thread.
+ */
+static struct sgreen *green_self();
+static void green_yield(struct sgreen *g);
+static void green_exit(struct sgreen *g, long ret);
+static void green_sleep(struct sgreen *g, long long ns);
+static void green_lock(struct sgreen *g, smutex_t *mutex);
+static int green_wait(struct sgreen *g, scond_t *cond, smutex_t *mutex,
+                      long long timeout);
+static void green_wake(void *obj, int all);
+static long long green_clock();
+
 /*
  * sthread_create()
  *
@@ -109,6 +127,11 @@ void sthread_create_p(sthread_t *thread,
  */
 void sthread_yield()
 {
+  struct sgreen *g = green_self();
+  if(g != NULL){
+    green_yield(g);
+    return;
+  }
   int err = sched_yield();
   assert(err == 0);
   return;
@@ -176,6 +199,10 @@ void sthread_exit(int ret)
    * into a pointer and cast it.
    */
   assert(sizeof(int) <= sizeof(void *));
+  struct sgreen *g = green_self();
+  if(g != NULL){
+    green_exit(g, ret);
+  }
   pthread_exit((void *)(intptr_t)ret);
 }
 
@@ -200,7 +227,12 @@ void sthread_exit_p(void *ret)
 void sthread_sleep(unsigned int seconds, unsigned int nanoseconds)
 {
   struct timespec rqt;
+  struct sgreen *g = green_self();
   assert(nanoseconds < 1000000000);
+  if(g != NULL){
+    green_sleep(g, (long long)seconds * 1000000000 + nanoseconds);
+    return;
+  }
   rqt.tv_sec = seconds;
   rqt.tv_nsec = nanoseconds;
   if(nanosleep(&rqt, NULL) != 0){
@@ -214,36 +246,300 @@ void sthread_sleep(unsigned int seconds, unsigned int nanoseconds)
 
 
 
+/*
+ * Lock profiling (see sthread.h)
+ *
+ * The statistics live in a table keyed by the lock's address, so
+ * smutex_t stays a plain pthread mutex and profiled and ordinary
+ * builds can be mixed freely by callers. smutex_init() and
+ * scond_init() claim an entry with a compare-and-swap within
+ * PROFILE_PROBES slots of the address's hash, and lookups from the
+ * lock and wait calls look no further, stopping early at a slot
+ * never used; so a full table costs a lock call a few probes, not
+ * a scan. Destroying a lock adds its counts to the retired entry
+ * for its name and frees its slot for reuse. A mutex's entry is
+ * only written by the thread holding it, and a condition
+ * variable's by a waiter holding the associated mutex.
+ */
+#ifdef STHREAD_PROFILE
+#define PROFILE_PROBES 16
+#define PROFILE_FREED ((const void *)1) // slot of a destroyed lock
+#define PROFILE_RETIRED 64
+
+struct lock_profile {
+  const void *lock;
+  struct sthread_lock_stats stats;
+  long long locked_at; // when the holder got the mutex, 0 if unknown
+};
+
+static struct lock_profile lock_profiles[STHREAD_PROFILE_LOCKS];
+
+// destroyed locks' counts, one entry per name and kind
+static struct sthread_lock_stats retired[PROFILE_RETIRED];
+static int nretired;
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long long profile_now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static unsigned long profile_hash(const void *lock)
+{
+  return (unsigned long)((uintptr_t)lock >> 3) * 0x9e3779b97f4a7c15ul >> 32;
+}
+
+/*
+ * profile_of()
+ *
+ * The entry for lock, or NULL if its init found no room.
+ */
+static struct lock_profile *profile_of(const void *lock)
+{
+  unsigned long h = profile_hash(lock);
+  struct lock_profile *p;
+  const void *seen;
+  int n;
+
+  for(n = 0; n < PROFILE_PROBES; n++){
+    p = &lock_profiles[(h + n) % STHREAD_PROFILE_LOCKS];
+    seen = __atomic_load_n(&p->lock, __ATOMIC_ACQUIRE);
+    if(seen == lock){
+      return p;
+    }
+    if(seen == NULL){
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * profile_claim()
+ *
+ * Give the lock being initialized an entry, unless all of its
+ * PROFILE_PROBES slots are taken.
+ */
+static void profile_claim(const void *lock, int cond)
+{
+  unsigned long h = profile_hash(lock);
+  struct lock_profile *p;
+  const void *seen;
+  int n;
+
+  if(profile_of(lock) != NULL){
+    return; // initialized again without being destroyed
+  }
+  for(n = 0; n < PROFILE_PROBES; n++){
+    p = &lock_profiles[(h + n) % STHREAD_PROFILE_LOCKS];
+    seen = __atomic_load_n(&p->lock, __ATOMIC_ACQUIRE);
+    if((seen == NULL || seen == PROFILE_FREED) &&
+       __atomic_compare_exchange_n(&p->lock, &seen, lock, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+      p->stats.cond = cond;
+      p->stats.locks = 1;
+      return;
+    }
+  }
+}
+
+static int profile_same_name(const char *a, const char *b)
+{
+  return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+/*
+ * profile_retire()
+ *
+ * lock is being destroyed: add its counts to the retired ones of
+ * the same name and kind, and free its slot.
+ */
+static void profile_retire(const void *lock)
+{
+  struct lock_profile *p = profile_of(lock);
+  struct sthread_lock_stats *r;
+  int i;
+
+  if(p == NULL){
+    return;
+  }
+  pthread_mutex_lock(&retired_mutex);
+  for(i = 0; i < nretired; i++){
+    if(retired[i].cond == p->stats.cond &&
+       profile_same_name(retired[i].name, p->stats.name)){
+      break;
+    }
+  }
+  if(i == nretired && nretired < PROFILE_RETIRED){
+    retired[nretired++] = p->stats;
+  }
+  else if(i < nretired){
+    r = &retired[i];
+    r->locks += p->stats.locks;
+    r->acquisitions += p->stats.acquisitions;
+    r->contended += p->stats.contended;
+    r->wait_ns += p->stats.wait_ns;
+    r->hold_ns += p->stats.hold_ns;
+    if(p->stats.max_wait_ns > r->max_wait_ns){
+      r->max_wait_ns = p->stats.max_wait_ns;
+    }
+    if(p->stats.max_hold_ns > r->max_hold_ns){
+      r->max_hold_ns = p->stats.max_hold_ns;
+    }
+  }
+  pthread_mutex_unlock(&retired_mutex);
+  memset(&p->stats, 0, sizeof(p->stats));
+  p->locked_at = 0;
+  __atomic_store_n(&p->lock, PROFILE_FREED, __ATOMIC_RELEASE);
+}
+
+static void profile_wait(struct sthread_lock_stats *st, long long wait)
+{
+  st->wait_ns += wait;
+  if(wait > st->max_wait_ns){
+    st->max_wait_ns = wait;
+  }
+}
+
+// mutex was just acquired, after blocking since start if nonzero
+static void profile_acquired(smutex_t *mutex, long long start)
+{
+  struct lock_profile *p = profile_of(mutex);
+  long long now;
+
+  if(p == NULL){
+    return;
+  }
+  now = profile_now();
+  p->stats.acquisitions++;
+  if(start != 0){
+    p->stats.contended++;
+    profile_wait(&p->stats, now - start);
+  }
+  p->locked_at = now;
+}
+
+// mutex is about to be released
+static void profile_released(smutex_t *mutex)
+{
+  struct lock_profile *p = profile_of(mutex);
+  long long hold;
+
+  if(p == NULL || p->locked_at == 0){
+    return;
+  }
+  hold = profile_now() - p->locked_at;
+  p->stats.hold_ns += hold;
+  if(hold > p->stats.max_hold_ns){
+    p->stats.max_hold_ns = hold;
+  }
+  p->locked_at = 0;
+}
+
+// a wait on cond that started at start is over and mutex held again
+static void profile_waited(scond_t *cond, smutex_t *mutex, long long start)
+{
+  struct lock_profile *c = profile_of(cond);
+  struct lock_profile *m = profile_of(mutex);
+  long long now = profile_now();
+
+  if(c != NULL){
+    c->stats.acquisitions++;
+    profile_wait(&c->stats, now - start);
+  }
+  if(m != NULL){
+    m->locked_at = now;
+  }
+}
+#endif
+
 void smutex_init(smutex_t *mutex)
 {
   if(pthread_mutex_init(mutex, NULL)){
       perror("pthread_mutex_init failed");
       exit(-1);
   }    
+#ifdef STHREAD_PROFILE
+  profile_claim(mutex, 0);
+#endif
 }
 
 void smutex_destroy(smutex_t *mutex)
 {
+#ifdef STHREAD_PROFILE
+  profile_retire(mutex);
+#endif
   if(pthread_mutex_destroy(mutex)){
       perror("pthread_mutex_destroy failed");
       exit(-1);
   }    
 }
 
+void smutex_init_named(smutex_t *mutex, const char *name)
+{
+  smutex_init(mutex);
+#ifdef STHREAD_PROFILE
+  struct lock_profile *p = profile_of(mutex);
+  if(p != NULL){
+    p->stats.name = name;
+  }
+#endif
+}
+
 void smutex_lock(smutex_t *mutex)
 {
-  if(pthread_mutex_lock(mutex)){
+  struct sgreen *g = green_self();
+#ifdef STHREAD_PROFILE
+  long long start;
+
+  if(pthread_mutex_trylock(mutex) == 0){
+    profile_acquired(mutex, 0);
+    return;
+  }
+  start = profile_now();
+#endif
+  if(g != NULL){
+    green_lock(g, mutex);
+  }
+  else if(pthread_mutex_lock(mutex)){
     perror("pthread_mutex_lock failed");
     exit(-1);
   }    
+#ifdef STHREAD_PROFILE
+  profile_acquired(mutex, start);
+#endif
+}
+
+int smutex_trylock(smutex_t *mutex)
+{
+  int err = pthread_mutex_trylock(mutex);
+
+  if(err == EBUSY){
+    return 0;
+  }
+  if(err){
+    errno = err;
+    perror("pthread_mutex_trylock failed");
+    exit(-1);
+  }
+#ifdef STHREAD_PROFILE
+  profile_acquired(mutex, 0);
+#endif
+  return 1;
 }
 
 void smutex_unlock(smutex_t *mutex)
 {
+#ifdef STHREAD_PROFILE
+  profile_released(mutex);
+#endif
   if(pthread_mutex_unlock(mutex)){
     perror("pthread_mutex_unlock failed");
     exit(-1);
   }    
+  green_wake(mutex, 0);
 }
 
 
@@ -254,10 +550,27 @@ void scond_init(scond_t *cond)
       perror("pthread_cond_init failed");
       exit(-1);
   }
+#ifdef STHREAD_PROFILE
+  profile_claim(cond, 1);
+#endif
+}
+
+void scond_init_named(scond_t *cond, const char *name)
+{
+  scond_init(cond);
+#ifdef STHREAD_PROFILE
+  struct lock_profile *p = profile_of(cond);
+  if(p != NULL){
+    p->stats.name = name;
+  }
+#endif
 }
 
 void scond_destroy(scond_t *cond)
 {
+#ifdef STHREAD_PROFILE
+  profile_retire(cond);
+#endif
   if(pthread_cond_destroy(cond)){
       perror("pthread_cond_destroy failed");
       exit(-1);
@@ -274,6 +587,7 @@ void scond_signal(scond_t *cond, smutex_t *muted /* NOTUSED */)
     perror("pthread_cond_signal failed");
     exit(-1);
   }
+  green_wake(cond, 0);
 }
 
 void scond_broadcast(scond_t *cond, smutex_t *mutex /* NOTUSED */)
@@ -285,6 +599,7 @@ void scond_broadcast(scond_t *cond, smutex_t *mutex /* NOTUSED */)
     perror("pthread_cond_broadcast failed");
     exit(-1);
   }
+  green_wake(cond, 1);
 }
 
 void scond_wait(scond_t *cond, smutex_t *mutex)
@@ -292,11 +607,1880 @@ void scond_wait(scond_t *cond, smutex_t *mutex)
   //
   // assert(mutex is held by this thread);
   //
+  struct sgreen *g = green_self();
+#ifdef STHREAD_PROFILE
+  long long start = profile_now();
 
-  if(pthread_cond_wait(cond, mutex)){
+  profile_released(mutex);
+#endif
+  if(g != NULL){
+    green_wait(g, cond, mutex, -1);
+  }
+  else if(pthread_cond_wait(cond, mutex)){
     perror("pthread_cond_wait failed");
     exit(-1);
   }
+#ifdef STHREAD_PROFILE
+  profile_waited(cond, mutex, start);
+#endif
+}
+
+int scond_timedwait(scond_t *cond, smutex_t *mutex,
+                    unsigned int seconds, unsigned int nanoseconds)
+{
+  struct timespec abstime;
+  struct sgreen *g = green_self();
+  int err;
+
+  //
+  // assert(mutex is held by this thread);
+  //
+  assert(nanoseconds < 1000000000);
+#ifdef STHREAD_PROFILE
+  long long start = profile_now();
+
+  profile_released(mutex);
+#endif
+  if(g != NULL){
+    err = green_wait(g, cond, mutex,
+                     (long long)seconds * 1000000000 + nanoseconds) ?
+          0 : ETIMEDOUT;
+  }
+  else{
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_sec += seconds;
+    abstime.tv_nsec += nanoseconds;
+    if(abstime.tv_nsec >= 1000000000){
+      abstime.tv_sec++;
+      abstime.tv_nsec -= 1000000000;
+    }
+    err = pthread_cond_timedwait(cond, mutex, &abstime);
+  }
+#ifdef STHREAD_PROFILE
+  profile_waited(cond, mutex, start);
+#endif
+  if(err == ETIMEDOUT){
+    return 0;
+  }
+  if(err){
+    errno = err;
+    perror("pthread_cond_timedwait failed");
+    exit(-1);
+  }
+  return 1;
+}
+
+int sthread_lock_stats(struct sthread_lock_stats *stats, int max)
+{
+  int n = 0;
+#ifdef STHREAD_PROFILE
+  const void *lock;
+  int i;
+
+  for(i = 0; i < STHREAD_PROFILE_LOCKS && n < max; i++){
+    lock = __atomic_load_n(&lock_profiles[i].lock, __ATOMIC_ACQUIRE);
+    if(lock != NULL && lock != PROFILE_FREED){
+      stats[n] = lock_profiles[i].stats;
+      stats[n].lock = lock;
+      n++;
+    }
+  }
+  pthread_mutex_lock(&retired_mutex);
+  for(i = 0; i < nretired && n < max; i++){
+    stats[n] = retired[i];
+    stats[n].lock = NULL;
+    n++;
+  }
+  pthread_mutex_unlock(&retired_mutex);
+#endif
+  return n;
+}
+
+
+/*
+ * Parallel loops
+ *
+ * One job at a time runs on a lazily grown pool of worker threads;
+ * the calling thread participates as well, so a pool of
+ * sthread_ncpus() - 1 workers keeps every core busy. Chunks are
+ * handed out through an atomic counter so that fast threads pick
+ * up the slack of slow ones.
+ */
+struct pfor_job {
+  long end;
+  long grain;
+  long next;          // first unclaimed iteration
+  int slots;          // workers still allowed to join this job
+  void (*for_fn)(long, long, void *);
+  long (*reduce_fn)(long, long, void *);
+  long (*combine)(long, long);
+  long identity;
+  long result;        // protected by pool.mutex
+  void *ctx;
+};
+
+static struct {
+  smutex_t mutex;
+  scond_t work;       // a new job was posted
+  scond_t done;       // a worker is finished with the current job
+  int nworkers;
+  int busy;           // a job is running
+  int active;         // workers that have not left the current job
+  unsigned long generation;
+  struct pfor_job *job;
+} pool;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static int ncpus_override;
+static __thread int in_pool_job;
+
+static void pool_init()
+{
+  smutex_init_named(&pool.mutex, "sthread pool");
+  scond_init_named(&pool.work, "sthread pool work");
+  scond_init_named(&pool.done, "sthread pool done");
+}
+
+/*
+ * pfor_run()
+ *
+ * Claim and run chunks of job until none are left.
+ */
+static void pfor_run(struct pfor_job *job)
+{
+  long lo, hi;
+  long acc = job->identity;
+  int nested = in_pool_job;
+
+  in_pool_job = 1;
+  while((lo = __atomic_fetch_add(&job->next, job->grain,
+                                 __ATOMIC_RELAXED)) < job->end){
+    hi = (job->end - lo > job->grain) ? lo + job->grain : job->end;
+    if(job->for_fn){
+      job->for_fn(lo, hi, job->ctx);
+    }
+    else{
+      acc = job->combine(acc, job->reduce_fn(lo, hi, job->ctx));
+    }
+  }
+  in_pool_job = nested;
+
+  if(job->reduce_fn){
+    smutex_lock(&pool.mutex);
+    job->result = job->combine(job->result, acc);
+    smutex_unlock(&pool.mutex);
+  }
+}
+
+static void *pool_worker(void *arg)
+{
+  unsigned long seen = (unsigned long)(uintptr_t)arg;
+  struct pfor_job *job;
+  int joined;
+
+  smutex_lock(&pool.mutex);
+  for(;;){
+    while(pool.generation == seen){
+      scond_wait(&pool.work, &pool.mutex);
+    }
+    seen = pool.generation;
+    job = pool.job;
+    joined = job->slots > 0;
+    if(joined){
+      job->slots--;
+    }
+    smutex_unlock(&pool.mutex);
+
+    if(joined){
+      pfor_run(job);
+    }
+
+    smutex_lock(&pool.mutex);
+    if(--pool.active == 0){
+      scond_signal(&pool.done, &pool.mutex);
+    }
+  }
+  return NULL; // Not reached
+}
+
+/*
+ * sthread_ncpus()
+ *
+ * Number of threads a parallel loop spreads its work over.
+ */
+int sthread_ncpus()
+{
+  char *env;
+  long n;
+
+  if(ncpus_override > 0){
+    return ncpus_override;
+  }
+  env = getenv("STHREAD_NCPUS");
+  if(env != NULL && atoi(env) > 0){
+    return atoi(env);
+  }
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+void sthread_set_ncpus(int ncpus)
+{
+  ncpus_override = ncpus;
+}
+
+/*
+ * pfor_start()
+ *
+ * Run job on the pool and the calling thread, and return once
+ * every participant is done with it. If the pool is already
+ * running a job, or there is only one core to run on, the caller
+ * simply does all the work itself.
+ */
+static void pfor_start(struct pfor_job *job)
+{
+  sthread_t worker;
+  int helpers = sthread_ncpus() - 1;
+  long chunks = (job->end - job->next + job->grain - 1) / job->grain;
+
+  if(helpers > chunks - 1){
+    helpers = (int)(chunks - 1);
+  }
+  pthread_once(&pool_once, pool_init);
+
+  smutex_lock(&pool.mutex);
+  if(in_pool_job || pool.busy || helpers <= 0){
+    smutex_unlock(&pool.mutex);
+    pfor_run(job);
+    return;
+  }
+  while(pool.nworkers < helpers){
+    sthread_create_p(&worker, pool_worker,
+                     (void *)(uintptr_t)pool.generation);
+    pool.nworkers++;
+  }
+  pool.busy = 1;
+  pool.job = job;
+  job->slots = helpers;
+  pool.active = pool.nworkers;
+  pool.generation++;
+  scond_broadcast(&pool.work, &pool.mutex);
+  smutex_unlock(&pool.mutex);
+
+  pfor_run(job);
+
+  smutex_lock(&pool.mutex);
+  while(pool.active > 0){
+    scond_wait(&pool.done, &pool.mutex);
+  }
+  pool.job = NULL;
+  pool.busy = 0;
+  smutex_unlock(&pool.mutex);
+}
+
+static long pfor_grain(long begin, long end, long grain)
+{
+  if(grain > 0){
+    return grain;
+  }
+  // a few chunks per core so uneven chunks still balance out
+  grain = (end - begin) / ((long)sthread_ncpus() * 4);
+  return grain > 0 ? grain : 1;
+}
+
+/*
+ * sthread_parallel_for()
+ *
+ * Call fn(lo, hi, ctx) over disjoint chunks covering [begin, end).
+ */
+void sthread_parallel_for(long begin, long end, long grain,
+                          void (*fn)(long, long, void *),
+                          void *ctx)
+{
+  struct pfor_job job = {0};
+
+  if(begin >= end){
+    return;
+  }
+  job.next = begin;
+  job.end = end;
+  job.grain = pfor_grain(begin, end, grain);
+  job.for_fn = fn;
+  job.ctx = ctx;
+  pfor_start(&job);
+}
+
+/*
+ * sthread_parallel_reduce()
+ *
+ * Fold fn(lo, hi, ctx) over disjoint chunks covering [begin, end)
+ * with combine(), starting from identity.
+ */
+long sthread_parallel_reduce(long begin, long end, long grain,
+                             long (*fn)(long, long, void *),
+                             long (*combine)(long, long),
+                             long identity, void *ctx)
+{
+  struct pfor_job job = {0};
+
+  if(begin >= end){
+    return identity;
+  }
+  job.next = begin;
+  job.end = end;
+  job.grain = pfor_grain(begin, end, grain);
+  job.reduce_fn = fn;
+  job.combine = combine;
+  job.identity = identity;
+  job.result = identity;
+  job.ctx = ctx;
+  pfor_start(&job);
+  return job.result;
+}
+
+
+
+/*
+ * Futures
+ *
+ * Each future has its own mutex and condition variable for plain
+ * waits. Continuations and wait_any() callers hang off the future
+ * in lists that sfuture_set() walks once the value is in. A
+ * wait_any() caller has one list link per future it is waiting on,
+ * all pointing to the same waiter. Lock order is future, then
+ * waiter.
+ */
+struct sfuture_cont {
+  void *(*fn)(void *, void *);
+  void *arg;
+  sfuture_t *next;
+  struct sfuture_cont *link;
+};
+
+struct sfuture_waiter {
+  smutex_t mutex;
+  scond_t cond;
+  int fired;
+};
+
+struct sfuture_link {
+  struct sfuture_waiter *waiter;
+  struct sfuture_link *next;
+};
+
+static long long monotonic_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void sfuture_init(sfuture_t *f)
+{
+  smutex_init_named(&f->mutex, "sfuture");
+  scond_init_named(&f->cond, "sfuture");
+  f->ready = 0;
+  f->value = NULL;
+  f->conts = NULL;
+  f->waiters = NULL;
+}
+
+void sfuture_destroy(sfuture_t *f)
+{
+  struct sfuture_cont *c;
+
+  // continuations on a future that was never fulfilled never run
+  while((c = f->conts) != NULL){
+    f->conts = c->link;
+    free(c);
+  }
+  assert(f->waiters == NULL);
+  scond_destroy(&f->cond);
+  smutex_destroy(&f->mutex);
+}
+
+/*
+ * sfuture_set()
+ *
+ * Fulfil f with value, wake everyone waiting on it and run its
+ * continuations. A future may only be set once.
+ */
+void sfuture_set(sfuture_t *f, void *value)
+{
+  struct sfuture_cont *c;
+  struct sfuture_link *l;
+
+  smutex_lock(&f->mutex);
+  assert(!f->ready);
+  f->ready = 1;
+  f->value = value;
+  c = f->conts;
+  f->conts = NULL;
+  for(l = f->waiters; l != NULL; l = l->next){
+    smutex_lock(&l->waiter->mutex);
+    l->waiter->fired = 1;
+    scond_signal(&l->waiter->cond, &l->waiter->mutex);
+    smutex_unlock(&l->waiter->mutex);
+  }
+  scond_broadcast(&f->cond, &f->mutex);
+  smutex_unlock(&f->mutex);
+
+  while(c != NULL){
+    struct sfuture_cont *link = c->link;
+    sfuture_set(c->next, c->fn(value, c->arg));
+    free(c);
+    c = link;
+  }
+}
+
+int sfuture_ready(sfuture_t *f)
+{
+  int ready;
+
+  smutex_lock(&f->mutex);
+  ready = f->ready;
+  smutex_unlock(&f->mutex);
+  return ready;
+}
+
+void *sfuture_wait(sfuture_t *f)
+{
+  void *value;
+
+  smutex_lock(&f->mutex);
+  while(!f->ready){
+    scond_wait(&f->cond, &f->mutex);
+  }
+  value = f->value;
+  smutex_unlock(&f->mutex);
+  return value;
+}
+
+int sfuture_timedwait(sfuture_t *f, unsigned int seconds,
+                      unsigned int nanoseconds, void **value)
+{
+  long long deadline, left;
+  int ready;
+
+  deadline = green_clock() + (long long)seconds * 1000000000 + nanoseconds;
+  smutex_lock(&f->mutex);
+  while(!f->ready){
+    left = deadline - green_clock();
+    if(left <= 0){
+      break;
+    }
+    scond_timedwait(&f->cond, &f->mutex,
+                    left / 1000000000, left % 1000000000);
+  }
+  ready = f->ready;
+  if(ready && value != NULL){
+    *value = f->value;
+  }
+  smutex_unlock(&f->mutex);
+  return ready;
+}
+
+void sfuture_then(sfuture_t *f, void *(*fn)(void *, void *), void *arg,
+                  sfuture_t *next)
+{
+  struct sfuture_cont *c;
+  void *value;
+
+  smutex_lock(&f->mutex);
+  if(f->ready){
+    value = f->value;
+    smutex_unlock(&f->mutex);
+    sfuture_set(next, fn(value, arg));
+    return;
+  }
+  c = (struct sfuture_cont *)malloc(sizeof(*c));
+  if(c == NULL){
+    perror("sfuture_then failed");
+    exit(-1);
+  }
+  c->fn = fn;
+  c->arg = arg;
+  c->next = next;
+  c->link = f->conts;
+  f->conts = c;
+  smutex_unlock(&f->mutex);
 }
 
+static void sfuture_unlink(sfuture_t *f, struct sfuture_link *link)
+{
+  struct sfuture_link **pp;
+
+  smutex_lock(&f->mutex);
+  for(pp = &f->waiters; *pp != NULL; pp = &(*pp)->next){
+    if(*pp == link){
+      *pp = link->next;
+      break;
+    }
+  }
+  smutex_unlock(&f->mutex);
+}
 
+/*
+ * sfuture_wait_any()
+ *
+ * Register one waiter with every future that is not yet ready
+ * (stopping early at the first one that is), sleep until one of
+ * them fires it, then take the waiter off all the lists again.
+ */
+int sfuture_wait_any(sfuture_t **futures, int n)
+{
+  struct sfuture_waiter waiter;
+  struct sfuture_link *links;
+  int i, linked, found = -1;
+
+  assert(n > 0);
+  links = (struct sfuture_link *)malloc(n * sizeof(*links));
+  if(links == NULL){
+    perror("sfuture_wait_any failed");
+    exit(-1);
+  }
+  smutex_init_named(&waiter.mutex, "sfuture waiter");
+  scond_init_named(&waiter.cond, "sfuture waiter");
+  waiter.fired = 0;
+
+  for(linked = 0; linked < n; linked++){
+    sfuture_t *f = futures[linked];
+    smutex_lock(&f->mutex);
+    if(f->ready){
+      smutex_unlock(&f->mutex);
+      found = linked;
+      break;
+    }
+    links[linked].waiter = &waiter;
+    links[linked].next = f->waiters;
+    f->waiters = &links[linked];
+    smutex_unlock(&f->mutex);
+  }
+
+  if(found < 0){
+    smutex_lock(&waiter.mutex);
+    while(!waiter.fired){
+      scond_wait(&waiter.cond, &waiter.mutex);
+    }
+    smutex_unlock(&waiter.mutex);
+  }
+
+  for(i = 0; i < linked; i++){
+    sfuture_unlink(futures[i], &links[i]);
+  }
+  for(i = 0; found < 0 && i < n; i++){
+    if(sfuture_ready(futures[i])){
+      found = i;
+    }
+  }
+  assert(found >= 0);
+
+  free(links);
+  scond_destroy(&waiter.cond);
+  smutex_destroy(&waiter.mutex);
+  return found;
+}
+
+void sfuture_wait_all(sfuture_t **futures, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    sfuture_wait(futures[i]);
+  }
+}
+
+
+
+/*
+ * Bounded queues
+ *
+ * In the MPMC ring every cell carries a sequence number that tells
+ * producers and consumers whose turn it is: a cell at position pos
+ * is free for the producer claiming pos when seq == pos, and full
+ * for the consumer claiming pos when seq == pos + 1. Positions are
+ * claimed with a CAS on head (producers) or tail (consumers).
+ *
+ * Parking uses the usual Dekker handshake: a waiter bumps its
+ * counter and retries before sleeping, and the other side checks
+ * the counter after a full fence, so one of them always sees the
+ * other's update.
+ *
+ * The waking side still touches the queue after its item became
+ * visible, if only to load the parked count, so blocking calls
+ * count themselves in pushing/popping and destroy waits for both
+ * to drain. The count goes up before the item is published, so a
+ * thread that took the item and then destroys the queue sees it.
+ */
+static unsigned long queue_capacity(unsigned long capacity)
+{
+  unsigned long n = 2;
+
+  while(n < capacity){
+    n <<= 1;
+  }
+  return n;
+}
+
+static void *queue_alloc(unsigned long bytes)
+{
+  void *mem;
+
+  if(posix_memalign(&mem, STHREAD_CACHELINE, bytes)){
+    perror("queue allocation failed");
+    exit(-1);
+  }
+  return mem;
+}
+
+static void park_init(struct squeue_park *park)
+{
+  smutex_init_named(&park->mutex, "squeue park");
+  scond_init_named(&park->not_empty, "squeue not empty");
+  scond_init_named(&park->not_full, "squeue not full");
+  park->consumers = 0;
+  park->producers = 0;
+}
+
+static void park_destroy(struct squeue_park *park, int *pushing, int *popping)
+{
+  while(__atomic_load_n(pushing, __ATOMIC_ACQUIRE) > 0 ||
+        __atomic_load_n(popping, __ATOMIC_ACQUIRE) > 0){
+    sthread_yield();
+  }
+  scond_destroy(&park->not_full);
+  scond_destroy(&park->not_empty);
+  smutex_destroy(&park->mutex);
+}
+
+/*
+ * park_wake()
+ *
+ * Wake the threads parked on cond, if there are any.
+ */
+static void park_wake(struct squeue_park *park, int *parked, scond_t *cond)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(parked, __ATOMIC_RELAXED) > 0){
+    smutex_lock(&park->mutex);
+    scond_broadcast(cond, &park->mutex);
+    smutex_unlock(&park->mutex);
+  }
+}
+
+void squeue_init(squeue_t *q, unsigned long capacity)
+{
+  unsigned long i;
+
+  capacity = queue_capacity(capacity);
+  q->cells = (struct squeue_cell *)queue_alloc(capacity * sizeof(*q->cells));
+  for(i = 0; i < capacity; i++){
+    q->cells[i].seq = i;
+    q->cells[i].data = NULL;
+  }
+  q->mask = capacity - 1;
+  q->head = 0;
+  q->tail = 0;
+  q->pushing = 0;
+  q->popping = 0;
+  park_init(&q->park);
+}
+
+void squeue_destroy(squeue_t *q)
+{
+  park_destroy(&q->park, &q->pushing, &q->popping);
+  free(q->cells);
+}
+
+int squeue_trypush(squeue_t *q, void *item)
+{
+  struct squeue_cell *cell;
+  unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  long diff;
+
+  for(;;){
+    cell = &q->cells[pos & q->mask];
+    diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+    if(diff == 0){
+      if(__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+        break;
+      }
+    }
+    else if(diff < 0){
+      return 0; // full
+    }
+    else{
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+  }
+  cell->data = item;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+int squeue_trypop(squeue_t *q, void **item)
+{
+  struct squeue_cell *cell;
+  unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  long diff;
+
+  for(;;){
+    cell = &q->cells[pos & q->mask];
+    diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+    if(diff == 0){
+      if(__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+        break;
+      }
+    }
+    else if(diff < 0){
+      return 0; // empty
+    }
+    else{
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+  *item = cell->data;
+  __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void squeue_push(squeue_t *q, void *item)
+{
+  struct squeue_park *park = &q->park;
+
+  __atomic_add_fetch(&q->pushing, 1, __ATOMIC_RELAXED);
+  if(!squeue_trypush(q, item)){
+    smutex_lock(&park->mutex);
+    __atomic_add_fetch(&park->producers, 1, __ATOMIC_SEQ_CST);
+    while(!squeue_trypush(q, item)){
+      scond_wait(&park->not_full, &park->mutex);
+    }
+    __atomic_sub_fetch(&park->producers, 1, __ATOMIC_RELAXED);
+    smutex_unlock(&park->mutex);
+  }
+  park_wake(park, &park->consumers, &park->not_empty);
+  __atomic_sub_fetch(&q->pushing, 1, __ATOMIC_RELEASE);
+}
+
+void *squeue_pop(squeue_t *q)
+{
+  struct squeue_park *park = &q->park;
+  void *item;
+
+  __atomic_add_fetch(&q->popping, 1, __ATOMIC_RELAXED);
+  if(!squeue_trypop(q, &item)){
+    smutex_lock(&park->mutex);
+    __atomic_add_fetch(&park->consumers, 1, __ATOMIC_SEQ_CST);
+    while(!squeue_trypop(q, &item)){
+      scond_wait(&park->not_empty, &park->mutex);
+    }
+    __atomic_sub_fetch(&park->consumers, 1, __ATOMIC_RELAXED);
+    smutex_unlock(&park->mutex);
+  }
+  park_wake(park, &park->producers, &park->not_full);
+  __atomic_sub_fetch(&q->popping, 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+/*
+ * The SPSC ring needs no CAS: head is only written by the producer
+ * and tail only by the consumer. Each side keeps a cached copy of
+ * the other's index and only rereads the shared one when the
+ * cached value says the ring is full (or empty).
+ */
+void sspsc_init(sspsc_t *q, unsigned long capacity)
+{
+  capacity = queue_capacity(capacity);
+  q->slots = (void **)queue_alloc(capacity * sizeof(*q->slots));
+  q->mask = capacity - 1;
+  q->head = 0;
+  q->tail_cache = 0;
+  q->tail = 0;
+  q->head_cache = 0;
+  q->pushing = 0;
+  q->popping = 0;
+  park_init(&q->park);
+}
+
+void sspsc_destroy(sspsc_t *q)
+{
+  park_destroy(&q->park, &q->pushing, &q->popping);
+  free(q->slots);
+}
+
+int sspsc_trypush(sspsc_t *q, void *item)
+{
+  unsigned long head = q->head;
+
+  if(head - q->tail_cache > q->mask){
+    q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if(head - q->tail_cache > q->mask){
+      return 0; // full
+    }
+  }
+  q->slots[head & q->mask] = item;
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+int sspsc_trypop(sspsc_t *q, void **item)
+{
+  unsigned long tail = q->tail;
+
+  if(tail == q->head_cache){
+    q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if(tail == q->head_cache){
+      return 0; // empty
+    }
+  }
+  *item = q->slots[tail & q->mask];
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void sspsc_push(sspsc_t *q, void *item)
+{
+  struct squeue_park *park = &q->park;
+
+  __atomic_add_fetch(&q->pushing, 1, __ATOMIC_RELAXED);
+  if(!sspsc_trypush(q, item)){
+    smutex_lock(&park->mutex);
+    __atomic_add_fetch(&park->producers, 1, __ATOMIC_SEQ_CST);
+    while(!sspsc_trypush(q, item)){
+      scond_wait(&park->not_full, &park->mutex);
+    }
+    __atomic_sub_fetch(&park->producers, 1, __ATOMIC_RELAXED);
+    smutex_unlock(&park->mutex);
+  }
+  park_wake(park, &park->consumers, &park->not_empty);
+  __atomic_sub_fetch(&q->pushing, 1, __ATOMIC_RELEASE);
+}
+
+void *sspsc_pop(sspsc_t *q)
+{
+  struct squeue_park *park = &q->park;
+  void *item;
+
+  __atomic_add_fetch(&q->popping, 1, __ATOMIC_RELAXED);
+  if(!sspsc_trypop(q, &item)){
+    smutex_lock(&park->mutex);
+    __atomic_add_fetch(&park->consumers, 1, __ATOMIC_SEQ_CST);
+    while(!sspsc_trypop(q, &item)){
+      scond_wait(&park->not_empty, &park->mutex);
+    }
+    __atomic_sub_fetch(&park->consumers, 1, __ATOMIC_RELAXED);
+    smutex_unlock(&park->mutex);
+  }
+  park_wake(park, &park->producers, &park->not_full);
+  __atomic_sub_fetch(&q->popping, 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+
+
+/*
+ * Staged pipelines
+ *
+ * Shutdown works by sending one stop marker per worker into the
+ * first stage. A worker that pops a marker exits, and the last
+ * worker of a stage to exit sends markers on to the next stage.
+ * At that point every other worker of the stage has exited too, so
+ * all real items are already ahead of the markers downstream.
+ */
+static char spipeline_stop;
+
+static void *spipeline_worker(void *arg)
+{
+  struct spipeline_stage *stage = (struct spipeline_stage *)arg;
+  spipeline_t *p = stage->pipe;
+  struct spipeline_stage *next = NULL;
+  void *item;
+  int last, i;
+
+  if(stage + 1 < p->stages + p->nstages){
+    next = stage + 1;
+  }
+  for(;;){
+    item = squeue_pop(&stage->in);
+    if(item == &spipeline_stop){
+      break;
+    }
+    item = stage->fn(item, stage->ctx);
+    if(item != NULL && next != NULL){
+      squeue_push(&next->in, item);
+    }
+  }
+
+  smutex_lock(&p->mutex);
+  last = ++stage->exited == stage->nworkers;
+  smutex_unlock(&p->mutex);
+  if(last && next != NULL){
+    for(i = 0; i < next->nworkers; i++){
+      squeue_push(&next->in, &spipeline_stop);
+    }
+  }
+  return NULL;
+}
+
+void spipeline_init(spipeline_t *p)
+{
+  p->nstages = 0;
+  p->running = 0;
+  smutex_init_named(&p->mutex, "spipeline");
+}
+
+void spipeline_destroy(spipeline_t *p)
+{
+  int i;
+
+  assert(!p->running);
+  for(i = 0; i < p->nstages; i++){
+    squeue_destroy(&p->stages[i].in);
+    free(p->stages[i].workers);
+  }
+  smutex_destroy(&p->mutex);
+}
+
+/*
+ * spipeline_add_stage()
+ *
+ * Append a stage with nworkers threads running fn, fed by a queue
+ * holding up to depth items.
+ */
+void spipeline_add_stage(spipeline_t *p, void *(*fn)(void *, void *),
+                         void *ctx, int nworkers, unsigned long depth)
+{
+  struct spipeline_stage *stage;
+
+  assert(!p->running);
+  assert(p->nstages < SPIPELINE_MAX_STAGES);
+  assert(nworkers > 0);
+  stage = &p->stages[p->nstages++];
+  stage->fn = fn;
+  stage->ctx = ctx;
+  stage->nworkers = nworkers;
+  stage->exited = 0;
+  stage->pipe = p;
+  // room for the stop markers on top of the requested depth
+  squeue_init(&stage->in, depth + nworkers);
+  stage->workers = (sthread_t *)malloc(nworkers * sizeof(sthread_t));
+  if(stage->workers == NULL){
+    perror("spipeline_add_stage failed");
+    exit(-1);
+  }
+}
+
+void spipeline_start(spipeline_t *p)
+{
+  int i, j;
+
+  assert(!p->running && p->nstages > 0);
+  p->running = 1;
+  for(i = 0; i < p->nstages; i++){
+    p->stages[i].exited = 0;
+    for(j = 0; j < p->stages[i].nworkers; j++){
+      sthread_create_p(&p->stages[i].workers[j], spipeline_worker,
+                       &p->stages[i]);
+    }
+  }
+}
+
+/*
+ * spipeline_submit()
+ *
+ * Feed item to the first stage, waiting for room if its queue is
+ * full.
+ */
+void spipeline_submit(spipeline_t *p, void *item)
+{
+  assert(p->running && item != NULL);
+  squeue_push(&p->stages[0].in, item);
+}
+
+void spipeline_finish(spipeline_t *p)
+{
+  int i, j;
+
+  assert(p->running);
+  for(j = 0; j < p->stages[0].nworkers; j++){
+    squeue_push(&p->stages[0].in, &spipeline_stop);
+  }
+  for(i = 0; i < p->nstages; i++){
+    for(j = 0; j < p->stages[i].nworkers; j++){
+      sthread_join_p(p->stages[i].workers[j]);
+    }
+  }
+  p->running = 0;
+}
+
+
+/*
+ * Green threads
+ *
+ * Green threads are user-level threads with their own small stacks
+ * that sgreen_run() multiplexes onto a few OS "carrier" threads.
+ * A green thread that would block (sleep, wait
+ * for a mutex or a condition variable) instead saves its context
+ * and switches back to its carrier, which picks the next runnable
+ * green thread from a shared run queue.
+ *
+ * Threads parked on a mutex or condition variable wait in a hash
+ * table of wait lists keyed by the object's address, since smutex_t
+ * and scond_t are plain pthread objects with no room for a list of
+ * their own. smutex_unlock() and scond_signal()/broadcast() look
+ * in that table too, but only when some green thread is parked.
+ * Sleeping (and timed waits) use a heap of deadlines.
+ *
+ * A switching-out thread must not be resumed by another carrier
+ * before its context is saved, so anything that would make it
+ * findable (releasing the wait list lock, inserting it into the run
+ * queue or timer heap) is left to its carrier as a post-switch
+ * action. Green threads may migrate between carriers across any
+ * blocking call, so the thread-local variables below are only ever
+ * read through green_self() and green_home(), which the compiler
+ * cannot cache across a switch.
+ *
+ * Migration also means a green thread can lock a pthread mutex on
+ * one carrier and unlock it on another. POSIX leaves unlocking a
+ * mutex from a thread that does not own it undefined; we rely on
+ * glibc's default mutex type (what smutex_init() creates), which
+ * does not track the owner, and would break with error-checking
+ * or recursive mutexes.
+ *
+ * In virtual time mode (sgreen_set_virtual()) sleeps and timeouts
+ * run on a simulated clock instead: when no green thread is running
+ * or runnable, the clock jumps straight to the earliest deadline in
+ * the heap. Nothing actually sleeps, and threads still wake in
+ * deadline order.
+ *
+ * Lock order: wait list, then scheduler.
+ */
+#define GREEN_STACK (64 * 1024)
+#define GREEN_BUCKETS 256
+
+/*
+ * Context switching
+ *
+ * On x86-64 we switch stacks by hand: only the callee-saved
+ * registers and the FPU/SSE control words need saving, and doing
+ * it ourselves avoids the two sigprocmask() system calls that
+ * swapcontext() makes on every switch. Elsewhere fall back on
+ * ucontext.
+ */
+#if defined(__x86_64__)
+struct green_ctx {
+  void *sp;
+};
+
+void green_ctx_jump(void **save_sp, void *new_sp);
+__asm__(
+  ".text\n"
+  ".type green_ctx_jump, @function\n"
+  "green_ctx_jump:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  ldmxcsr (%rsp)\n"
+  "  fldcw 4(%rsp)\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size green_ctx_jump, .-green_ctx_jump\n");
+
+static void green_ctx_switch(struct green_ctx *from, struct green_ctx *to)
+{
+  green_ctx_jump(&from->sp, to->sp);
+}
+
+/*
+ * Lay out a fresh stack the way green_ctx_jump() leaves a
+ * switched-out one, with entry as the return address. The slot
+ * above it is a null return address for entry, which never
+ * returns, placed so the stack is aligned as after a call.
+ */
+static void green_ctx_make(struct green_ctx *ctx, char *stack, size_t size,
+                           void (*entry)())
+{
+  uintptr_t *sp = (uintptr_t *)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+  uint32_t csr[2];
+  uint16_t cw;
+
+  __asm__ volatile("stmxcsr %0" : "=m"(csr[0]));
+  __asm__ volatile("fnstcw %0" : "=m"(cw));
+  csr[1] = cw;
+
+  *--sp = 0;                   // entry's return address
+  *--sp = (uintptr_t)entry;    // green_ctx_jump's return address
+  sp -= 6;                     // rbp, rbx, r12-r15
+  memset(sp, 0, 6 * sizeof(*sp));
+  *--sp = (uintptr_t)csr[0] | ((uintptr_t)csr[1] << 32);
+  ctx->sp = sp;
+}
+#else
+struct green_ctx {
+  ucontext_t uc;
+};
+
+static void green_ctx_switch(struct green_ctx *from, struct green_ctx *to)
+{
+  swapcontext(&from->uc, &to->uc);
+}
+
+static void green_ctx_make(struct green_ctx *ctx, char *stack, size_t size,
+                           void (*entry)())
+{
+  getcontext(&ctx->uc);
+  ctx->uc.uc_stack.ss_sp = stack;
+  ctx->uc.uc_stack.ss_size = size;
+  ctx->uc.uc_link = NULL;
+  makecontext(&ctx->uc, entry, 0);
+}
+#endif
+
+enum green_post { POST_NONE, POST_YIELD, POST_SLEEP, POST_PARK, POST_EXIT };
+enum green_state { GREEN_RUNNING, GREEN_PARKED, GREEN_WOKEN };
+
+struct green_bucket {
+  pthread_mutex_t lock;
+  struct sgreen *head;
+  struct sgreen *tail;
+};
+
+struct sgreen {
+  struct green_ctx ctx;
+  char *stack;
+  void (*fn)(int);
+  int arg;
+  long ret;
+  int done;
+  int state;                     // GREEN_*, changed with CAS while parked
+  int timedout;                  // woken by its deadline, not a signal
+  long long wake;                // deadline in ns, or -1 for none
+  int heapidx;                   // slot in the timer heap, -1 if not in it
+  void *waitobj;                 // mutex or condition variable parked on
+  struct green_bucket *bucket;   // wait list parked in, if any
+  struct sgreen *next;           // run queue or wait list link
+  enum green_post post;          // what the carrier does after switching
+  smutex_t *post_mutex;          // user mutex to release once parked
+  sthread_rng_t rng;             // see sthread_rng()
+  int rng_seeded;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t idle;           // runnable threads or timers for carriers
+  struct sgreen *runhead;
+  struct sgreen *runtail;
+  struct sgreen **heap;          // timer min-heap on wake
+  int nheap;
+  int heapcap;
+  int live;                      // green threads that have not exited
+  int nidle;                     // carriers waiting on green.idle
+  int running;                   // carriers busy with a green thread
+  int virtual;                   // deadlines are on the virtual clock
+  long long vnow;                // the virtual clock, in ns
+} green = { PTHREAD_MUTEX_INITIALIZER };
+
+static struct green_bucket green_buckets[GREEN_BUCKETS];
+static pthread_once_t green_once = PTHREAD_ONCE_INIT;
+static int green_parked;         // threads in any wait list
+static int green_used;           // green_init() has run, see green_wake()
+
+static __thread struct sgreen *green_cur;
+static __thread struct green_ctx *green_carrier_ctx;
+
+static void green_init()
+{
+  pthread_condattr_t attr;
+  int i;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&green.idle, &attr);
+  pthread_condattr_destroy(&attr);
+  for(i = 0; i < GREEN_BUCKETS; i++){
+    pthread_mutex_init(&green_buckets[i].lock, NULL);
+  }
+  __atomic_store_n(&green_used, 1, __ATOMIC_SEQ_CST);
+}
+
+static __attribute__((noinline)) struct sgreen *green_self()
+{
+  return green_cur;
+}
+
+static __attribute__((noinline)) struct green_ctx *green_home()
+{
+  return green_carrier_ctx;
+}
+
+static struct green_bucket *green_bucket_of(void *obj)
+{
+  uintptr_t h = (uintptr_t)obj;
+
+  h ^= h >> 17;
+  h *= 0x9e3779b97f4a7c15ULL;
+  return &green_buckets[(h >> 32) % GREEN_BUCKETS];
+}
+
+static int green_heap_less(int a, int b)
+{
+  return green.heap[a]->wake < green.heap[b]->wake;
+}
+
+static void green_heap_swap(int a, int b)
+{
+  struct sgreen *t = green.heap[a];
+
+  green.heap[a] = green.heap[b];
+  green.heap[b] = t;
+  green.heap[a]->heapidx = a;
+  green.heap[b]->heapidx = b;
+}
+
+static void green_heap_fix(int i)
+{
+  int child;
+
+  while(i > 0 && green_heap_less(i, (i - 1) / 2)){
+    green_heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  for(;;){
+    child = 2 * i + 1;
+    if(child >= green.nheap){
+      break;
+    }
+    if(child + 1 < green.nheap && green_heap_less(child + 1, child)){
+      child++;
+    }
+    if(!green_heap_less(child, i)){
+      break;
+    }
+    green_heap_swap(i, child);
+    i = child;
+  }
+}
+
+// must hold green.lock
+static void green_heap_push(struct sgreen *g)
+{
+  if(green.nheap == green.heapcap){
+    green.heapcap = green.heapcap ? 2 * green.heapcap : 64;
+    green.heap = (struct sgreen **)realloc(green.heap,
+                                           green.heapcap * sizeof(*green.heap));
+    if(green.heap == NULL){
+      perror("green timer heap allocation failed");
+      exit(-1);
+    }
+  }
+  g->heapidx = green.nheap++;
+  green.heap[g->heapidx] = g;
+  green_heap_fix(g->heapidx);
+}
+
+// must hold green.lock
+static void green_heap_remove(struct sgreen *g)
+{
+  int i = g->heapidx;
+
+  assert(i >= 0);
+  green.nheap--;
+  if(i != green.nheap){
+    green_heap_swap(i, green.nheap);
+    green_heap_fix(i);
+  }
+  g->heapidx = -1;
+}
+
+// must hold green.lock
+static void green_enqueue(struct sgreen *g)
+{
+  g->state = GREEN_RUNNING;
+  g->next = NULL;
+  if(green.runtail){
+    green.runtail->next = g;
+  }
+  else{
+    green.runhead = g;
+  }
+  green.runtail = g;
+  if(green.nidle > 0){
+    pthread_cond_signal(&green.idle);
+  }
+}
+
+static void green_ready(struct sgreen *g)
+{
+  pthread_mutex_lock(&green.lock);
+  if(g->heapidx >= 0){
+    green_heap_remove(g);
+  }
+  green_enqueue(g);
+  pthread_mutex_unlock(&green.lock);
+}
+
+static long long green_clock()
+{
+  if(green.virtual){
+    return __atomic_load_n(&green.vnow, __ATOMIC_RELAXED);
+  }
+  return monotonic_ns();
+}
+
+// must hold b->lock
+static int green_unlink(struct green_bucket *b, struct sgreen *g)
+{
+  struct sgreen **pp, *prev = NULL;
+
+  for(pp = &b->head; *pp != NULL; prev = *pp, pp = &(*pp)->next){
+    if(*pp == g){
+      *pp = g->next;
+      if(b->tail == g){
+        b->tail = prev;
+      }
+      __atomic_sub_fetch(&green_parked, 1, __ATOMIC_RELAXED);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * green_wake()
+ *
+ * Make the green threads parked on obj runnable again, just one
+ * of them unless all is set. A thread whose deadline fired at the
+ * same time belongs to the timer, so it does not count.
+ *
+ * Every smutex_unlock() and scond_signal()/broadcast() comes
+ * through here, so programs that never create a green thread must
+ * not pay for the fence: green_used is set once, before the first
+ * green thread exists, and until then there is nothing to wake. A
+ * thread that shares locks with green threads has seen green_used
+ * by the time it matters, since it was created after the first
+ * sgreen_create() or has synchronized with that thread since.
+ */
+static void green_wake(void *obj, int all)
+{
+  struct green_bucket *b;
+  struct sgreen *g, *next;
+
+  if(!__atomic_load_n(&green_used, __ATOMIC_RELAXED)){
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&green_parked, __ATOMIC_RELAXED) == 0){
+    return;
+  }
+  b = green_bucket_of(obj);
+  pthread_mutex_lock(&b->lock);
+  for(g = b->head; g != NULL; g = next){
+    next = g->next;
+    if(g->waitobj != obj){
+      continue;
+    }
+    green_unlink(b, g);
+    g->bucket = NULL;
+    if(__sync_bool_compare_and_swap(&g->state, GREEN_PARKED, GREEN_WOKEN)){
+      green_ready(g);
+      if(!all){
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&b->lock);
+}
+
+// called with green.lock held, which it may drop and retake
+static void green_fire_timers()
+{
+  struct sgreen *g;
+  struct green_bucket *b;
+  long long now;
+
+  now = green_clock();
+  while(green.nheap > 0 && green.heap[0]->wake <= now){
+    g = green.heap[0];
+    green_heap_remove(g);
+    if(!__sync_bool_compare_and_swap(&g->state, GREEN_PARKED, GREEN_WOKEN)){
+      continue; // signalled at the same time
+    }
+    g->timedout = 1;
+    if((b = g->bucket) != NULL){
+      pthread_mutex_unlock(&green.lock);
+      pthread_mutex_lock(&b->lock);
+      green_unlink(b, g);
+      g->bucket = NULL;
+      pthread_mutex_unlock(&b->lock);
+      pthread_mutex_lock(&green.lock);
+    }
+    green_enqueue(g);
+  }
+}
+
+static void green_switch(struct sgreen *g)
+{
+  green_ctx_switch(&g->ctx, green_home());
+}
+
+static void green_exit(struct sgreen *g, long ret)
+{
+  g->ret = ret;
+  g->post = POST_EXIT;
+  green_switch(g);
+  assert(0); // Not reached
+}
+
+static void green_start()
+{
+  struct sgreen *g = green_self();
+
+  g->fn(g->arg);
+  green_exit(g, 0);
+}
+
+/*
+ * green_after()
+ *
+ * Finish what g asked for when it switched back to this carrier.
+ */
+static void green_after(struct sgreen *g)
+{
+  struct green_bucket *b;
+
+  switch(g->post){
+  case POST_YIELD:
+    green_ready(g);
+    break;
+  case POST_SLEEP:
+    pthread_mutex_lock(&green.lock);
+    green_heap_push(g);
+    pthread_mutex_unlock(&green.lock);
+    break;
+  case POST_PARK:
+    b = g->bucket;
+    if(g->wake >= 0){
+      pthread_mutex_lock(&green.lock);
+      green_heap_push(g);
+      pthread_mutex_unlock(&green.lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+    if(g->post_mutex != NULL){
+      smutex_unlock(g->post_mutex);
+    }
+    break;
+  case POST_EXIT:
+    munmap(g->stack, GREEN_STACK);
+    g->stack = NULL;
+    pthread_mutex_lock(&green.lock);
+    g->done = 1;
+    if(--green.live == 0){
+      pthread_cond_broadcast(&green.idle);
+    }
+    pthread_mutex_unlock(&green.lock);
+    break;
+  case POST_NONE:
+    break;
+  }
+}
+
+static void *green_carrier(void *unused)
+{
+  struct green_ctx home;
+  struct sgreen *g;
+  struct timespec deadline;
+
+  green_carrier_ctx = &home;
+  pthread_mutex_lock(&green.lock);
+  for(;;){
+    green_fire_timers();
+    if((g = green.runhead) != NULL){
+      green.runhead = g->next;
+      if(green.runhead == NULL){
+        green.runtail = NULL;
+      }
+      green.running++;
+      pthread_mutex_unlock(&green.lock);
+
+      g->post = POST_NONE;
+      green_cur = g;
+      green_ctx_switch(&home, &g->ctx);
+      green_cur = NULL;
+      green_after(g);
+
+      pthread_mutex_lock(&green.lock);
+      green.running--;
+      continue;
+    }
+    if(green.live == 0){
+      break;
+    }
+    if(green.virtual && green.running == 0 && green.nheap > 0){
+      // everyone is waiting for time to pass, so make it pass
+      __atomic_store_n(&green.vnow, green.heap[0]->wake, __ATOMIC_RELAXED);
+      continue;
+    }
+    green.nidle++;
+    if(green.virtual){
+      pthread_cond_wait(&green.idle, &green.lock);
+    }
+    else if(green.nheap > 0){
+      deadline.tv_sec = green.heap[0]->wake / 1000000000;
+      deadline.tv_nsec = green.heap[0]->wake % 1000000000;
+      pthread_cond_timedwait(&green.idle, &green.lock, &deadline);
+    }
+    else{
+      pthread_cond_wait(&green.idle, &green.lock);
+    }
+    green.nidle--;
+  }
+  pthread_mutex_unlock(&green.lock);
+  green_carrier_ctx = NULL;
+  return NULL;
+}
+
+/*
+ * green_park()
+ *
+ * Park the current green thread on obj in wait list b (whose lock
+ * the caller holds) until woken or until the deadline, if any. The
+ * carrier releases b and then mutex (if not NULL) once the thread
+ * is safely switched out. Returns 0 if the deadline fired.
+ */
+static int green_park(struct sgreen *g, struct green_bucket *b, void *obj,
+                      long long wake, smutex_t *mutex)
+{
+  g->state = GREEN_PARKED;
+  g->timedout = 0;
+  g->wake = wake;
+  g->waitobj = obj;
+  g->bucket = b;
+  g->next = NULL;
+  if(b->tail){
+    b->tail->next = g;
+  }
+  else{
+    b->head = g;
+  }
+  b->tail = g;
+  g->post = POST_PARK;
+  g->post_mutex = mutex;
+  green_switch(g);
+  return !g->timedout;
+}
+
+static void green_lock(struct sgreen *g, smutex_t *mutex)
+{
+  struct green_bucket *b = green_bucket_of(mutex);
+
+  while(pthread_mutex_trylock(mutex) != 0){
+    pthread_mutex_lock(&b->lock);
+    __atomic_add_fetch(&green_parked, 1, __ATOMIC_SEQ_CST);
+    if(pthread_mutex_trylock(mutex) == 0){
+      __atomic_sub_fetch(&green_parked, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&b->lock);
+      return;
+    }
+    green_park(g, b, mutex, -1, NULL);
+  }
+}
+
+static int green_wait(struct sgreen *g, scond_t *cond, smutex_t *mutex,
+                      long long timeout)
+{
+  struct green_bucket *b = green_bucket_of(cond);
+  int woken;
+
+  pthread_mutex_lock(&b->lock);
+  __atomic_add_fetch(&green_parked, 1, __ATOMIC_SEQ_CST);
+  woken = green_park(g, b, cond,
+                     timeout >= 0 ? green_clock() + timeout : -1, mutex);
+  green_lock(g, mutex);
+  return woken;
+}
+
+static void green_sleep(struct sgreen *g, long long ns)
+{
+  g->state = GREEN_PARKED;
+  g->bucket = NULL;
+  g->wake = green_clock() + ns;
+  g->post = POST_SLEEP;
+  green_switch(g);
+}
+
+static void green_yield(struct sgreen *g)
+{
+  g->post = POST_YIELD;
+  green_switch(g);
+}
+
+/*
+ * sgreen_create()
+ *
+ * Create a green thread that runs start_routine(arg) once
+ * sgreen_run() gets to it. May be called before sgreen_run() or
+ * from a running green thread.
+ */
+void sgreen_create(sgreen_t *thrd, void (*start_routine)(int), int arg)
+{
+  struct sgreen *g;
+
+  pthread_once(&green_once, green_init);
+  g = (struct sgreen *)calloc(1, sizeof(*g));
+  if(g == NULL){
+    perror("sgreen_create failed");
+    exit(-1);
+  }
+  g->stack = (char *)mmap(NULL, GREEN_STACK, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(g->stack == MAP_FAILED){
+    perror("sgreen_create stack allocation failed");
+    exit(-1);
+  }
+  // guard page at the bottom so an overflow faults instead of
+  // scribbling over the neighbouring stack
+  mprotect(g->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+  green_ctx_make(&g->ctx, g->stack, GREEN_STACK, green_start);
+  g->fn = start_routine;
+  g->arg = arg;
+  g->heapidx = -1;
+  g->wake = -1;
+
+  pthread_mutex_lock(&green.lock);
+  green.live++;
+  green_enqueue(g);
+  pthread_mutex_unlock(&green.lock);
+  *thrd = g;
+}
+
+/*
+ * sgreen_run()
+ *
+ * Run green threads on ncarriers OS threads (the calling thread
+ * being one of them) until every green thread has exited.
+ */
+void sgreen_run(int ncarriers)
+{
+  pthread_t *carriers;
+  int i;
+
+  assert(green_self() == NULL);
+  pthread_once(&green_once, green_init);
+  if(ncarriers < 1){
+    ncarriers = 1;
+  }
+  carriers = (pthread_t *)malloc(ncarriers * sizeof(pthread_t));
+  if(carriers == NULL){
+    perror("sgreen_run failed");
+    exit(-1);
+  }
+  for(i = 1; i < ncarriers; i++){
+    if(pthread_create(&carriers[i], NULL, green_carrier, NULL)){
+      perror("pthread_create failed");
+      exit(-1);
+    }
+  }
+  green_carrier(NULL);
+  for(i = 1; i < ncarriers; i++){
+    pthread_join(carriers[i], NULL);
+  }
+  free(carriers);
+}
+
+/*
+ * sgreen_join()
+ *
+ * Return the value an exited green thread passed to sthread_exit()
+ * (0 if its start routine returned) and release it.
+ */
+long sgreen_join(sgreen_t thrd)
+{
+  long ret;
+
+  assert(thrd->done);
+  ret = thrd->ret;
+  free(thrd);
+  return ret;
+}
+
+int sgreen_current()
+{
+  return green_self() != NULL;
+}
+
+/*
+ * sgreen_set_virtual()
+ *
+ * Turn virtual time on or off for the next sgreen_run(). While on,
+ * sthread_sleep() and timed waits in green threads take no real
+ * time, they just advance the clock that sthread_now_ns() reads.
+ * OS threads that sleep or block on I/O are not simulated, so all
+ * the threads being timed should be green.
+ */
+void sgreen_set_virtual(int on)
+{
+  pthread_mutex_lock(&green.lock);
+  green.virtual = on;
+  green.vnow = 0;
+  pthread_mutex_unlock(&green.lock);
+}
+
+/*
+ * sthread_now_ns()
+ *
+ * A monotonic clock in nanoseconds: the virtual clock if
+ * sgreen_set_virtual() turned it on, real time otherwise.
+ */
+long long sthread_now_ns()
+{
+  return green_clock();
+}
+
+
+/*
+ * Random numbers
+ *
+ * xoshiro256** by Blackman and Vigna, seeded through splitmix64 as
+ * they recommend so that similar seeds still give unrelated states.
+ */
+static unsigned long long splitmix64(unsigned long long *x)
+{
+  unsigned long long z = (*x += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void sthread_rng_seed(sthread_rng_t *rng, unsigned long long seed,
+                      unsigned long long stream)
+{
+  unsigned long long x = seed;
+  int i;
+
+  x ^= splitmix64(&stream);
+  for(i = 0; i < 4; i++){
+    rng->s[i] = splitmix64(&x);
+  }
+}
+
+static unsigned long long rotl(unsigned long long x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+unsigned long long sthread_rng_next(sthread_rng_t *rng)
+{
+  unsigned long long *s = rng->s;
+  unsigned long long result = rotl(s[1] * 5, 7) * 9;
+  unsigned long long t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+/*
+ * sthread_rng_below()
+ *
+ * Lemire's multiply-and-shift, with the rejection step that makes
+ * it exactly uniform; it rarely loops.
+ */
+unsigned long long sthread_rng_below(sthread_rng_t *rng, unsigned long long n)
+{
+  unsigned __int128 m;
+  unsigned long long low, threshold;
+
+  assert(n > 0);
+  m = (unsigned __int128)sthread_rng_next(rng) * n;
+  low = (unsigned long long)m;
+  if(low < n){
+    threshold = -n % n;
+    while(low < threshold){
+      m = (unsigned __int128)sthread_rng_next(rng) * n;
+      low = (unsigned long long)m;
+    }
+  }
+  return (unsigned long long)(m >> 64);
+}
+
+double sthread_rng_double(sthread_rng_t *rng)
+{
+  return (sthread_rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+static __thread sthread_rng_t rng_tls;
+static __thread int rng_tls_seeded;
+static unsigned long long rng_streams; // handed out by sthread_rng()
+
+sthread_rng_t *sthread_rng()
+{
+  struct sgreen *g = green_self();
+  sthread_rng_t *rng = g != NULL ? &g->rng : &rng_tls;
+  int *seeded = g != NULL ? &g->rng_seeded : &rng_tls_seeded;
+
+  if(!*seeded){
+    sthread_rng_seed(rng, 0,
+                     __atomic_fetch_add(&rng_streams, 1, __ATOMIC_RELAXED));
+    *seeded = 1;
+  }
+  return rng;
+}
+
+/*
+ * scounter_add()
+ *
+ * Threads only share a shard once there are more than
+ * SCOUNTER_SHARDS of them, so the atomic add is almost always on a
+ * line no other CPU is writing.
+ */
+static __thread int scounter_tls_shard = -1;
+static int scounter_shards; // handed out by scounter_add()
+
+void scounter_init(scounter_t *c)
+{
+  memset(c, 0, sizeof(*c));
+}
+
+void scounter_add(scounter_t *c, long n)
+{
+  if(scounter_tls_shard < 0){
+    scounter_tls_shard = __atomic_fetch_add(&scounter_shards, 1,
+                                            __ATOMIC_RELAXED) %
+                         SCOUNTER_SHARDS;
+  }
+  __atomic_add_fetch(&c->shard[scounter_tls_shard].value, n,
+                     __ATOMIC_RELAXED);
+}
+
+long scounter_read(const scounter_t *c)
+{
+  long sum = 0;
+  int i;
+
+  for(i = 0; i < SCOUNTER_SHARDS; i++){
+    sum += __atomic_load_n(&c->shard[i].value, __ATOMIC_RELAXED);
+  }
+  return sum;
+}
@@ -60,6 +60,12 @@ void sthread_exit_p(void *ret);
  */
 void sthread_sleep(unsigned int seconds, unsigned int nanoseconds);
 
+/*
+ * Current time in nanoseconds from an arbitrary start; simulated
+ * time while green threads run in virtual time mode.
+ */
+long long sthread_now_ns();
+
 
 
 /*
@@ -70,6 +76,12 @@ void smutex_destroy(smutex_t *mutex);
 void smutex_lock(smutex_t *mutex);
 void smutex_unlock(smutex_t *mutex);
 
+/*
+ * Lock the mutex only if that takes no waiting. Returns 1 if it is
+ * now held and 0 if somebody else holds it.
+ */
+int smutex_trylock(smutex_t *mutex);
+
 /*
  * API for condition variables
  */
@@ -88,6 +100,337 @@ void scond_signal(scond_t *cond, smutex_t *mutex);
 void scond_broadcast(scond_t *cond, smutex_t *mutex);
 void scond_wait(scond_t *cond, smutex_t *mutex);
 
+/*
+ * Like scond_wait(), but give up after the specified amount of
+ * time. Returns 1 if woken up (or spuriously woken) before the
+ * time ran out and 0 on timeout. Either way the mutex is held
+ * again on return.
+ */
+int scond_timedwait(scond_t *cond, smutex_t *mutex,
+                    unsigned int seconds, unsigned int nanoseconds);
+
+/*
+ * API for lock profiling
+ *
+ * When the library is built with -DSTHREAD_PROFILE (make profile,
+ * or make PROFILE=1 after make clean), every mutex and condition
+ * variable keeps statistics: for a mutex the number of
+ * smutex_lock() calls, how many found it held, the time spent
+ * blocked in them and the time it was held; for a condition
+ * variable the number of waits and the time spent in them (which
+ * does not count as holding the mutex). The _named init calls
+ * attach a name (which must stay valid) to show in the report;
+ * without the build option they are plain inits and
+ * sthread_lock_stats() returns nothing.
+ *
+ * sthread_lock_stats() fills in up to max entries, one per lock
+ * not yet destroyed, then one per name (and kind) of the destroyed
+ * ones with their counts summed and lock NULL, and returns how many
+ * it filled. Statistics are kept in a fixed table of
+ * STHREAD_PROFILE_LOCKS entries; a lock initialized when its part
+ * of the table is full is not profiled, and neither is one that
+ * was not set up with smutex_init() or scond_init(). A mutex's
+ * counts are updated while it is held, so taking them while other
+ * threads run is a momentary snapshot.
+ */
+#define STHREAD_PROFILE_LOCKS 1024
+
+struct sthread_lock_stats {
+  const void *lock;         // the smutex_t or scond_t
+  const char *name;         // NULL if not named
+  int cond;                 // a condition variable, not a mutex
+  int locks;                // locks counted: 1, or how many were retired
+  long acquisitions;        // lock calls, or waits on a condition
+  long contended;           // lock calls that had to wait
+  long long wait_ns;        // time blocked in lock or wait
+  long long max_wait_ns;
+  long long hold_ns;        // time held, mutexes only
+  long long max_hold_ns;
+};
+
+void smutex_init_named(smutex_t *mutex, const char *name);
+void scond_init_named(scond_t *cond, const char *name);
+int sthread_lock_stats(struct sthread_lock_stats *stats, int max);
+
+
+/*
+ * API for data-parallel loops
+ *
+ * sthread_parallel_for() splits [begin, end) into chunks of
+ * grain iterations and calls fn(chunk_begin, chunk_end, ctx) for
+ * each of them on a shared pool of worker threads (the caller
+ * helps too). It returns once every chunk is done. A grain of 0
+ * picks a chunk size from the number of available cores.
+ *
+ * sthread_parallel_reduce() does the same, except that each chunk
+ * returns a partial result and the partials are folded together
+ * with combine(), starting from identity. combine() must be
+ * associative and commutative since chunks finish in any order.
+ *
+ * The pool is sized by sthread_ncpus(), which is the number of
+ * online cores unless overridden by sthread_set_ncpus() or the
+ * STHREAD_NCPUS environment variable (handy for measuring
+ * speedup by core count). Calls made while the pool is busy,
+ * including calls from inside fn, run on the calling thread.
+ */
+int sthread_ncpus();
+void sthread_set_ncpus(int ncpus);
+void sthread_parallel_for(long begin, long end, long grain,
+                          void (*fn)(long, long, void *),
+                          void *ctx);
+long sthread_parallel_reduce(long begin, long end, long grain,
+                             long (*fn)(long, long, void *),
+                             long (*combine)(long, long),
+                             long identity, void *ctx);
+
+
+/*
+ * API for futures
+ *
+ * A future is a slot for a single result that some thread (any
+ * thread, not necessarily one created for the purpose) fills in
+ * exactly once with sfuture_set(). Other threads can block until
+ * the value is there, optionally with a timeout, or wait for the
+ * first (or all) of several futures.
+ *
+ * sfuture_then() chains a continuation: once f holds a value v,
+ * fn(v, arg) is called and its return value is stored in next.
+ * The continuation runs in the thread that fulfils f, or right
+ * away in the calling thread if f is already fulfilled, so it
+ * should be short.
+ */
+struct sfuture_cont;
+struct sfuture_link;
+
+typedef struct sfuture {
+  smutex_t mutex;
+  scond_t cond;
+  int ready;
+  void *value;
+  struct sfuture_cont *conts;   // continuations to run on set
+  struct sfuture_link *waiters; // wait_any callers to wake on set
+} sfuture_t;
+
+void sfuture_init(sfuture_t *f);
+void sfuture_destroy(sfuture_t *f);
+void sfuture_set(sfuture_t *f, void *value);
+int sfuture_ready(sfuture_t *f);
+void *sfuture_wait(sfuture_t *f);
+
+/*
+ * Returns 1 and stores the value in *value (if value is not NULL)
+ * when f is fulfilled within the specified time, 0 otherwise.
+ */
+int sfuture_timedwait(sfuture_t *f, unsigned int seconds,
+                      unsigned int nanoseconds, void **value);
+void sfuture_then(sfuture_t *f, void *(*fn)(void *, void *), void *arg,
+                  sfuture_t *next);
+
+/*
+ * Wait until at least one of futures[0..n-1] is fulfilled and
+ * return the index of one that is, or until all of them are.
+ */
+int sfuture_wait_any(sfuture_t **futures, int n);
+void sfuture_wait_all(sfuture_t **futures, int n);
+
+
+/*
+ * API for bounded queues
+ *
+ * squeue_t is a lock-free multi-producer multi-consumer ring of
+ * pointers (D. Vyukov's bounded MPMC queue); sspsc_t is a cheaper
+ * ring for exactly one producer and one consumer thread. The
+ * capacity is rounded up to a power of two.
+ *
+ * The try versions never block and return 0 if the queue is full
+ * (push) or empty (pop). The plain versions only fall back to a
+ * mutex and condition variable when they actually have to wait,
+ * and the other side only touches that mutex when somebody is
+ * parked on it, so the common case takes no locks at all.
+ *
+ * A queue may be destroyed as soon as its last item has been
+ * popped, even if the push that delivered it has not returned
+ * yet; destroy waits for blocking calls still in progress.
+ */
+#define STHREAD_CACHELINE 64
+
+struct squeue_cell {
+  unsigned long seq;
+  void *data;
+};
+
+struct squeue_park {
+  smutex_t mutex;
+  scond_t not_empty;
+  scond_t not_full;
+  int consumers;        // threads parked in pop
+  int producers;        // threads parked in push
+};
+
+typedef struct squeue {
+  struct squeue_cell *cells;
+  unsigned long mask;
+  unsigned long head __attribute__((aligned(STHREAD_CACHELINE)));
+  int pushing;                // blocking pushes in progress
+  unsigned long tail __attribute__((aligned(STHREAD_CACHELINE)));
+  int popping;                // blocking pops in progress
+  struct squeue_park park __attribute__((aligned(STHREAD_CACHELINE)));
+} squeue_t;
+
+typedef struct sspsc {
+  void **slots;
+  unsigned long mask;
+  unsigned long head __attribute__((aligned(STHREAD_CACHELINE)));
+  unsigned long tail_cache;   // producer's last look at tail
+  int pushing;                // blocking pushes in progress
+  unsigned long tail __attribute__((aligned(STHREAD_CACHELINE)));
+  unsigned long head_cache;   // consumer's last look at head
+  int popping;                // blocking pops in progress
+  struct squeue_park park __attribute__((aligned(STHREAD_CACHELINE)));
+} sspsc_t;
+
+void squeue_init(squeue_t *q, unsigned long capacity);
+void squeue_destroy(squeue_t *q);
+int squeue_trypush(squeue_t *q, void *item);
+int squeue_trypop(squeue_t *q, void **item);
+void squeue_push(squeue_t *q, void *item);
+void *squeue_pop(squeue_t *q);
+
+void sspsc_init(sspsc_t *q, unsigned long capacity);
+void sspsc_destroy(sspsc_t *q);
+int sspsc_trypush(sspsc_t *q, void *item);
+int sspsc_trypop(sspsc_t *q, void **item);
+void sspsc_push(sspsc_t *q, void *item);
+void *sspsc_pop(sspsc_t *q);
+
+
+/*
+ * API for staged pipelines
+ *
+ * A pipeline is a chain of stages connected by bounded squeue_t
+ * queues. Each stage runs fn(item, ctx) on its own set of worker
+ * threads; whatever fn returns is passed on to the next stage
+ * (the last stage's return value is dropped). Returning NULL
+ * drops the item, e.g. when fn handed it off somewhere else.
+ * Items themselves must not be NULL.
+ *
+ * A full queue blocks the stage (or spipeline_submit() caller)
+ * feeding it, so a slow stage pushes back on everything upstream
+ * instead of letting work pile up.
+ *
+ * spipeline_finish() waits until everything submitted so far has
+ * gone through the last stage, then stops the workers.
+ */
+#define SPIPELINE_MAX_STAGES 8
+
+struct spipeline;
+
+struct spipeline_stage {
+  void *(*fn)(void *, void *);
+  void *ctx;
+  int nworkers;
+  int exited;                // workers that have stopped
+  squeue_t in;               // items waiting for this stage
+  sthread_t *workers;
+  struct spipeline *pipe;
+};
+
+typedef struct spipeline {
+  int nstages;
+  int running;
+  smutex_t mutex;            // protects the exited counters
+  struct spipeline_stage stages[SPIPELINE_MAX_STAGES];
+} spipeline_t;
+
+void spipeline_init(spipeline_t *p);
+void spipeline_destroy(spipeline_t *p);
+void spipeline_add_stage(spipeline_t *p, void *(*fn)(void *, void *),
+                         void *ctx, int nworkers, unsigned long depth);
+void spipeline_start(spipeline_t *p);
+void spipeline_submit(spipeline_t *p, void *item);
+void spipeline_finish(spipeline_t *p);
+
+
+/*
+ * API for green threads
+ *
+ * Green threads are scheduled in user space: sgreen_run() runs all
+ * of them on a handful of OS threads ("carriers"), so thousands of
+ * them cost little more than their 64KB stacks. Inside a green
+ * thread, sthread_sleep(), sthread_yield(), sthread_exit() and the
+ * smutex/scond calls switch to another green thread instead of
+ * blocking the carrier, so ordinary sthread code runs unchanged.
+ * Other blocking calls (I/O, sthread_join()) do block the carrier.
+ *
+ * Green threads can share mutexes and condition variables with
+ * ordinary threads.
+ *
+ * sgreen_set_virtual(1) makes sleeps and timeouts in green threads
+ * advance a simulated clock (see sthread_now_ns()) rather than
+ * take real time, so sleep-heavy simulations run as fast as the
+ * CPU allows.
+ */
+typedef struct sgreen *sgreen_t;
+
+void sgreen_create(sgreen_t *thrd, void (*start_routine)(int), int arg);
+void sgreen_run(int ncarriers);
+long sgreen_join(sgreen_t thrd);
+int sgreen_current();
+void sgreen_set_virtual(int on);
+
+
+/*
+ * API for random numbers
+ *
+ * sthread_rng_t is a xoshiro256** generator: fast, statistically
+ * sound, and with no shared state, so threads that each use their
+ * own never contend. sthread_rng_seed() starts it at seed, and
+ * different streams of the same seed give independent sequences,
+ * e.g. one per worker numbered from 0, so every worker sees the
+ * same numbers run after run.
+ *
+ * sthread_rng() returns the calling thread's own generator (each
+ * green thread has its own too), seeded on first use from stream
+ * numbers handed out in order of first use.
+ */
+typedef struct sthread_rng {
+  unsigned long long s[4];
+} sthread_rng_t;
+
+void sthread_rng_seed(sthread_rng_t *rng, unsigned long long seed,
+                      unsigned long long stream);
+unsigned long long sthread_rng_next(sthread_rng_t *rng);
+// uniform in [0, n), n > 0
+unsigned long long sthread_rng_below(sthread_rng_t *rng, unsigned long long n);
+// uniform in [0, 1)
+double sthread_rng_double(sthread_rng_t *rng);
+sthread_rng_t *sthread_rng();
+
+
+/*
+ * API for sharded counters
+ *
+ * An scounter_t is a statistics counter that many threads bump
+ * without sharing a cache line: each OS thread (green threads use
+ * their carrier's) adds to its own shard, picked round robin on the
+ * thread's first use, and scounter_read() sums the shards. A read
+ * taken while others are adding is a momentary snapshot, not an
+ * atomic one across counters.
+ */
+#define SCOUNTER_SHARDS 32
+
+struct scounter_shard {
+  long value;
+} __attribute__((aligned(STHREAD_CACHELINE)));
+
+typedef struct scounter {
+  struct scounter_shard shard[SCOUNTER_SHARDS];
+} scounter_t;
+
+void scounter_init(scounter_t *c);
+void scounter_add(scounter_t *c, long n);
+long scounter_read(const scounter_t *c);
+
 
 
 #ifdef __cplusplus
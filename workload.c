@@ -0,0 +1,270 @@
+/*
+ * workload.c -- workload generation for cachetest
+ *
+ * See workload.h.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spec.h"
+#include "workload.h"
+
+#define DIST_ZIPF 0
+#define DIST_UNIFORM 1
+#define DIST_LATEST 2
+#define DIST_HOTSPOT 3
+#define DIST_SEQUENTIAL 4
+
+struct profile {
+  const char *name;
+  int weight[WORKLOAD_NOPS]; // read, update, insert, scan, rmw
+  int dist;
+  int scanlen;
+};
+
+static const struct profile profiles[] = {
+  { "a",          { 50, 50,  0,  0,  0 }, DIST_ZIPF,       1 },
+  { "b",          { 95,  5,  0,  0,  0 }, DIST_ZIPF,       1 },
+  { "c",          {100,  0,  0,  0,  0 }, DIST_ZIPF,       1 },
+  { "readonly",   {100,  0,  0,  0,  0 }, DIST_ZIPF,       1 },
+  { "d",          { 95,  0,  5,  0,  0 }, DIST_LATEST,     1 },
+  { "e",          {  0,  0,  5, 95,  0 }, DIST_ZIPF,     100 },
+  { "f",          { 50,  0,  0,  0, 50 }, DIST_ZIPF,       1 },
+  { "scan",       { 20,  0,  0, 80,  0 }, DIST_ZIPF,      32 },
+  { "latest",     { 80,  0, 20,  0,  0 }, DIST_LATEST,     1 },
+  { "uniform",    { 50, 50,  0,  0,  0 }, DIST_UNIFORM,    1 },
+  { "hotspot",    { 50, 50,  0,  0,  0 }, DIST_HOTSPOT,    1 },
+  { "sequential", {100,  0,  0,  0,  0 }, DIST_SEQUENTIAL, 1 },
+};
+
+static const char *opnames[WORKLOAD_NOPS] = {
+  "read", "update", "insert", "scan", "rmw"
+};
+
+struct workload {
+  char name[16];
+  int nblocks;
+  int weight[WORKLOAD_NOPS];
+  int total; // sum of weight
+  int dist;
+  int scanlen;
+  long shift; // hotspot: operations between moves
+  struct zipf zipf;
+  long latest; // last block inserted (mod nblocks), atomic
+};
+
+/*
+ * zipf_init()
+ *
+ * Vose's alias method: scale the n probabilities so they average
+ * 1, then repeatedly top up a column below 1 ("small") with the
+ * excess of one above 1 ("large"), which becomes its alias. Every
+ * column ends up holding exactly 1/n of the probability mass, split
+ * between itself and at most one alias.
+ */
+void zipf_init(struct zipf *z, int n, double theta)
+{
+  double *p, sum = 0;
+  int *small, *large, nsmall = 0, nlarge = 0, i, s, l;
+
+  assert(n > 0 && theta >= 0);
+  z->n = n;
+  z->theta = theta;
+  z->prob = (double *)malloc(n * sizeof(double));
+  z->alias = (int *)malloc(n * sizeof(int));
+  p = (double *)malloc(n * sizeof(double));
+  small = (int *)malloc(n * sizeof(int));
+  large = (int *)malloc(n * sizeof(int));
+  if(z->prob == NULL || z->alias == NULL || p == NULL || small == NULL ||
+     large == NULL){
+    perror("zipf table allocation failed");
+    exit(-1);
+  }
+
+  for(i = 0; i < n; i++){
+    p[i] = pow(i + 1, -theta);
+    sum += p[i];
+  }
+  for(i = 0; i < n; i++){
+    p[i] *= n / sum;
+    if(p[i] < 1){
+      small[nsmall++] = i;
+    }
+    else{
+      large[nlarge++] = i;
+    }
+  }
+  while(nsmall > 0 && nlarge > 0){
+    s = small[--nsmall];
+    l = large[--nlarge];
+    z->prob[s] = p[s];
+    z->alias[s] = l;
+    p[l] -= 1 - p[s];
+    if(p[l] < 1){
+      small[nsmall++] = l;
+    }
+    else{
+      large[nlarge++] = l;
+    }
+  }
+  // whatever is left is 1 up to rounding error
+  while(nlarge > 0){
+    l = large[--nlarge];
+    z->prob[l] = 1;
+    z->alias[l] = l;
+  }
+  while(nsmall > 0){
+    s = small[--nsmall];
+    z->prob[s] = 1;
+    z->alias[s] = s;
+  }
+  free(p);
+  free(small);
+  free(large);
+}
+
+void zipf_destroy(struct zipf *z)
+{
+  free(z->prob);
+  free(z->alias);
+}
+
+int zipf_sample(const struct zipf *z, sthread_rng_t *rng)
+{
+  int i = sthread_rng_below(rng, z->n);
+
+  return sthread_rng_double(rng) < z->prob[i] ? i : z->alias[i];
+}
+
+struct workload *workload_open(const char *spec, int nblocks)
+{
+  struct workload *w = (struct workload *)calloc(1, sizeof(*w));
+  const char *opts = strchr(spec, ',');
+  const struct profile *p = NULL;
+  size_t n = opts ? (size_t)(opts - spec) : strlen(spec);
+  char val[32];
+  double theta = 1.0;
+  size_t i;
+
+  if(w == NULL){
+    perror("workload allocation failed");
+    exit(-1);
+  }
+  for(i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++){
+    if(strlen(profiles[i].name) == n &&
+       strncmp(spec, profiles[i].name, n) == 0){
+      p = &profiles[i];
+    }
+  }
+  if(p == NULL){
+    fprintf(stderr, "workload: unknown profile \"%.*s\"\n", (int)n, spec);
+    exit(-1);
+  }
+  opts = opts ? opts + 1 : "";
+
+  strcpy(w->name, p->name);
+  w->nblocks = nblocks;
+  for(i = 0; i < WORKLOAD_NOPS; i++){
+    w->weight[i] = spec_number(opts, opnames[i], p->weight[i]);
+    w->total += w->weight[i];
+  }
+  w->dist = p->dist;
+  w->scanlen = spec_number(opts, "scanlen", p->scanlen);
+  w->shift = spec_number(opts, "shift", 1000);
+  if(spec_option(opts, "theta", val, sizeof(val)) && val[0]){
+    theta = strtod(val, NULL);
+  }
+  if(w->total <= 0 || w->scanlen < 1 || w->scanlen > nblocks ||
+     w->shift < 1 || theta < 0){
+    fprintf(stderr, "workload: need some operations, scanlen 1-%d, "
+            "positive shift and theta >= 0\n", nblocks);
+    exit(-1);
+  }
+  zipf_init(&w->zipf, nblocks, theta);
+  w->latest = nblocks - 1; // as if the blocks were inserted in order
+  return w;
+}
+
+void workload_close(struct workload *w)
+{
+  zipf_destroy(&w->zipf);
+  free(w);
+}
+
+const char *workload_name(const struct workload *w)
+{
+  return w->name;
+}
+
+const char *workload_op_name(int kind)
+{
+  assert(kind >= 0 && kind < WORKLOAD_NOPS);
+  return opnames[kind];
+}
+
+void workload_client_init(struct workload *w, struct workload_client *c,
+                          unsigned long long seed, int n)
+{
+  sthread_rng_seed(&c->rng, seed, n);
+  c->next = sthread_rng_below(&c->rng, w->nblocks);
+  c->ops = 0;
+}
+
+/*
+ * pick()
+ *
+ * Choose the block for c's next operation according to the
+ * profile's key distribution. Only hotspot needs to know how far
+ * along the run is, and it counts each client's operations rather
+ * than sharing a counter that every tester would bump on every
+ * operation; the testers draw at much the same rate, so their hot
+ * regions move together.
+ */
+static int pick(struct workload *w, struct workload_client *c)
+{
+  long hot, base;
+
+  switch(w->dist){
+  case DIST_UNIFORM:
+    return sthread_rng_below(&c->rng, w->nblocks);
+  case DIST_LATEST:
+    return (__atomic_load_n(&w->latest, __ATOMIC_RELAXED) -
+            zipf_sample(&w->zipf, &c->rng)) % w->nblocks;
+  case DIST_HOTSPOT:
+    hot = w->nblocks / 10 > 0 ? w->nblocks / 10 : 1;
+    base = c->ops++ / w->shift * hot;
+    if(hot == w->nblocks || sthread_rng_below(&c->rng, 10) < 9){
+      return (base + sthread_rng_below(&c->rng, hot)) % w->nblocks;
+    }
+    return (base + hot + sthread_rng_below(&c->rng, w->nblocks - hot)) %
+           w->nblocks;
+  case DIST_SEQUENTIAL:
+    return c->next;
+  default:
+    return zipf_sample(&w->zipf, &c->rng);
+  }
+}
+
+void workload_next(struct workload *w, struct workload_client *c,
+                   struct workload_op *op)
+{
+  int r = sthread_rng_below(&c->rng, w->total);
+
+  for(op->kind = 0; r >= w->weight[op->kind]; op->kind++){
+    r -= w->weight[op->kind];
+  }
+  op->count = 1;
+  if(op->kind == WORKLOAD_INSERT){
+    op->blocknum = __atomic_add_fetch(&w->latest, 1, __ATOMIC_RELAXED) %
+                   w->nblocks;
+    return;
+  }
+  op->blocknum = pick(w, c);
+  if(op->kind == WORKLOAD_SCAN){
+    op->count = 1 + sthread_rng_below(&c->rng, w->scanlen);
+  }
+  c->next = (op->blocknum + op->count) % w->nblocks;
+}
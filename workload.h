@@ -0,0 +1,101 @@
+#ifndef _WORKLOAD_H_
+#define _WORKLOAD_H_
+
+#include "sthread.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Workload generation for cachetest
+ *
+ * struct zipf samples 0..n-1 with probability proportional to
+ * 1/(k+1)^theta: theta 0 is uniform, 1 is classic Zipf (the old
+ * rejection sampler's distribution), and larger values concentrate
+ * the accesses on fewer blocks. zipf_init() builds a Walker/Vose
+ * alias table in O(n) time and space, after which zipf_sample()
+ * takes constant time however large n is. A table may be shared by
+ * any number of threads.
+ */
+struct zipf {
+  int n;
+  double theta;
+  double *prob; // chance of keeping column i rather than its alias
+  int *alias;
+};
+
+void zipf_init(struct zipf *z, int n, double theta);
+void zipf_destroy(struct zipf *z);
+int zipf_sample(const struct zipf *z, sthread_rng_t *rng);
+
+/*
+ * Workload profiles
+ *
+ * A workload hands each tester a stream of operations on the
+ * blocks 0..nblocks-1. The spec is NAME[,read=N][,update=N]
+ * [,insert=N][,scan=N][,rmw=N][,scanlen=N][,theta=T][,shift=N],
+ * where the numbers after NAME override the profile's relative
+ * weights of each kind of operation, scanlen is the longest scan
+ * (scans read 1..scanlen consecutive blocks) and theta the Zipf
+ * skew. The profiles are
+ *
+ *   a           50% reads, 50% updates, Zipf (YCSB workload A)
+ *   b           95% reads, 5% updates, Zipf (YCSB B)
+ *   c, readonly all reads, Zipf (YCSB C)
+ *   d           95% reads, 5% inserts, reads favour the most
+ *               recently inserted blocks (YCSB D)
+ *   e           95% scans of up to 100 blocks, 5% inserts (YCSB E)
+ *   f           50% reads, 50% read-modify-writes, Zipf (YCSB F)
+ *   scan        80% scans of up to 32 blocks, 20% reads
+ *   latest      80% reads, 20% inserts, favouring recent inserts
+ *   uniform     50% reads, 50% updates, every block equally likely
+ *   hotspot     50% reads, 50% updates, 90% of them on a tenth of
+ *               the blocks; the hot tenth moves on after every
+ *               shift operations of each tester (default 1000)
+ *   sequential  all reads, each tester walking the blocks in order
+ *               from a random starting point
+ *
+ * The block space is fixed, so an insert overwrites the block after
+ * the last one inserted, wrapping around at the end; "latest" picks
+ * blocks a Zipf distance behind the last insert. A workload may be
+ * shared by any number of testers, each with its own
+ * workload_client.
+ */
+#define WORKLOAD_READ 0
+#define WORKLOAD_UPDATE 1
+#define WORKLOAD_INSERT 2
+#define WORKLOAD_SCAN 3
+#define WORKLOAD_RMW 4
+#define WORKLOAD_NOPS 5
+
+struct workload;
+
+struct workload_client {
+  sthread_rng_t rng;
+  int next; // sequential profile: the block after the last one read
+  long ops; // hotspot profile: operations this client has drawn
+};
+
+struct workload_op {
+  int kind; // WORKLOAD_READ...WORKLOAD_RMW
+  int blocknum;
+  int count; // blocks in a scan, wrapping around at the end; else 1
+};
+
+struct workload *workload_open(const char *spec, int nblocks);
+void workload_close(struct workload *w);
+const char *workload_name(const struct workload *w);
+const char *workload_op_name(int kind);
+
+// client n draws from stream n of seed, see sthread_rng_seed()
+void workload_client_init(struct workload *w, struct workload_client *c,
+                          unsigned long long seed, int n);
+void workload_next(struct workload *w, struct workload_client *c,
+                   struct workload_op *op);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif